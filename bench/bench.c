@@ -0,0 +1,398 @@
+// Runs the benchmarks and prints their times as JSON.
+//
+// usage: bench [-n runs] [--check-pauses] eval
+//
+// Each Lisp workload is fed to eval on stdin, with stdout thrown away,
+// and timed from fork to exit. The reader and macro workloads are
+// generated here rather than checked in. The microbenchmarks call into
+// eval.c directly, which is why it's included rather than linked.
+//
+// The thread benchmarks run bench/gcthreads.lisp with --gc-threads set
+// to each power of two under the number of CPUs, and to the number of
+// CPUs. They report the time full collections spent marking and
+// sweeping, rather than the time of the whole run.
+//
+// The pause benchmarks run bench/pause.lisp with --gc-pause, and report
+// the longest pause of each run rather than its time, along with the
+// target. Pauses depend on how busy the machine is, so going over the
+// target only makes bench fail with --check-pauses.
+
+#define NOMAIN
+#include "../eval.c"
+
+#include <sys/wait.h>
+
+typedef struct Workload Workload;
+struct Workload {
+    char *name;
+    char *path; // a file in bench, or NULL if gen makes the input
+    void (*gen)(FILE *f);
+};
+
+typedef struct Micro Micro;
+struct Micro {
+    char *name;
+    void (*fn)(void);
+};
+
+int runs = 5;
+
+// now, from eval.c, is in seconds
+double
+nowms(void)
+{
+    return now()*1e3;
+}
+
+int
+cmpdouble(const void *a, const void *b)
+{
+    double x = *(double *)a, y = *(double *)b;
+    return (x > y) - (x < y);
+}
+
+int first = 1;
+
+// times holds runs entries, and is sorted. extra is any more fields for
+// the benchmark, each starting with ", ". Returns the median.
+double
+report(char *name, double *times, char *extra)
+{
+    qsort(times, runs, sizeof(double), cmpdouble);
+
+    double median = times[runs/2];
+    if (runs % 2 == 0) {
+        median = (times[runs/2 - 1] + times[runs/2]) / 2;
+    }
+
+    printf("%s\n    {\"name\": \"%s\", \"median_ms\": %.3f, \"min_ms\": %.3f, \"max_ms\": %.3f%s}",
+        first ? "" : ",", name, median, times[0], times[runs-1], extra);
+    first = 0;
+    fflush(stdout);
+
+    return median;
+}
+
+// A file of definitions with large quoted literals, so most of the
+// time goes to reading them.
+void
+genread(FILE *f)
+{
+    for (int i = 0; i < 2000; i++) {
+        fprintf(f, "(def data%d '(", i);
+        for (int j = 0; j < 50; j++) {
+            fprintf(f, "(item%d %d \"s%d\" (nested (%d . %d)) sym-%d)\n", j, i*j, j, i, -j, j%7);
+        }
+        fprintf(f, "))\n");
+    }
+}
+
+// Lots of small top level forms that each take several expansions.
+void
+genmacro(FILE *f)
+{
+    for (int i = 0; i < 5000; i++) {
+        fprintf(f, "(let* ((a %d) (b (+ a 1)) (c (let ((d b)) (* d 2))))\n", i);
+        fprintf(f, "    (letrec ((ev (fn (n) (if (= n 0) t (od (- n 1)))))\n");
+        fprintf(f, "             (od (fn (n) (if (= n 0) nil (ev (- n 1))))))\n");
+        fprintf(f, "        (let ((x (ev 4)) (y c)) y)))\n");
+    }
+}
+
+Workload workloads[] = {
+    {"fib", "bench/fib.lisp", NULL},
+    {"tak", "bench/tak.lisp", NULL},
+    {"nqueens", "bench/nqueens.lisp", NULL},
+    {"map", "bench/map.lisp", NULL},
+    {"macro", NULL, genmacro},
+    {"quasi", "bench/quasi.lisp", NULL},
+    {"read", NULL, genread},
+    {"print", "bench/print.lisp", NULL},
+};
+
+// argv is eval's, and in and out are its stdin and stdout.
+double
+runeval(char *argv[], int in, int out)
+{
+    if (lseek(in, 0, SEEK_SET) == -1) {
+        perror("bench: lseek");
+        exit(1);
+    }
+
+    double start = nowms();
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("bench: fork");
+        exit(1);
+    } else if (pid == 0) {
+        dup2(in, 0);
+        dup2(out, 1);
+        execv(argv[0], argv);
+        perror("bench: exec");
+        _exit(127);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        perror("bench: waitpid");
+        exit(1);
+    }
+
+    double t = nowms() - start;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "bench: %s failed\n", argv[0]);
+        exit(1);
+    }
+
+    return t;
+}
+
+void
+runworkload(char *eval, Workload *w)
+{
+    int in;
+
+    if (w->path != NULL) {
+        in = open(w->path, O_RDONLY);
+    } else {
+        FILE *f = tmpfile();
+        if (f == NULL) {
+            perror("bench: tmpfile");
+            exit(1);
+        }
+        w->gen(f);
+        fflush(f);
+        in = dup(fileno(f));
+        fclose(f);
+    }
+
+    if (in == -1) {
+        fprintf(stderr, "bench: can't open input for %s\n", w->name);
+        exit(1);
+    }
+
+    int out = open("/dev/null", O_WRONLY);
+    char *argv[] = {eval, NULL};
+    double times[runs];
+
+    // once to warm up, and to write lib.lisp's fasl if it's missing
+    runeval(argv, in, out);
+
+    for (int i = 0; i < runs; i++) {
+        times[i] = runeval(argv, in, out);
+    }
+
+    close(in);
+    close(out);
+    report(w->name, times, "");
+}
+
+// Sets nums to the last n numbers out holds, one to a line, and returns
+// 0 if it has fewer than that.
+int
+lastnumbers(FILE *out, long *nums, int n)
+{
+    char line[256];
+    int seen = 0;
+
+    rewind(out);
+    while (fgets(line, sizeof(line), out) != NULL) {
+        if (isdigit((unsigned char)line[0])) {
+            memmove(nums, nums+1, (n-1)*sizeof(long));
+            nums[n-1] = atol(line);
+            seen++;
+        }
+    }
+
+    return seen >= n;
+}
+
+// Runs eval on the file at path runs times with the arguments in args,
+// and sets results[i][j] to the i'th of the last n numbers the j'th run
+// printed.
+void
+runnumbers(char *eval, char *path, char **args, int n, double results[][runs])
+{
+    int in = open(path, O_RDONLY);
+    FILE *out = tmpfile();
+    if (in == -1 || out == NULL) {
+        fprintf(stderr, "bench: can't open files for %s\n", path);
+        exit(1);
+    }
+
+    char *argv[8] = {eval};
+    for (int i = 0; args[i] != NULL; i++) {
+        argv[i+1] = args[i];
+    }
+
+    for (int j = 0; j < runs; j++) {
+        if (ftruncate(fileno(out), 0) == -1) {
+            perror("bench: ftruncate");
+            exit(1);
+        }
+        runeval(argv, in, fileno(out));
+
+        long nums[n];
+        if (!lastnumbers(out, nums, n)) {
+            fprintf(stderr, "bench: no results from %s\n", path);
+            exit(1);
+        }
+        for (int i = 0; i < n; i++) {
+            results[i][j] = nums[i];
+        }
+    }
+
+    close(in);
+    fclose(out);
+}
+
+// Pause targets, in microseconds. What's compared with them is CPU time,
+// since the wall clock also counts however long the OS had eval
+// descheduled.
+int pausetargets[] = {1000, 5000};
+
+// Returns 0 if the median of the longest pauses was over target.
+int
+runpause(char *eval, int target)
+{
+    char arg[32];
+    snprintf(arg, sizeof(arg), "%d", target);
+    char *args[] = {"--gc-pause", arg, NULL};
+    double pauses[1][runs];
+
+    // the last number printed is the pause, in microseconds
+    runnumbers(eval, "bench/pause.lisp", args, 1, pauses);
+    for (int i = 0; i < runs; i++) {
+        pauses[0][i] /= 1e3;
+    }
+
+    char name[32], extra[64];
+    snprintf(name, sizeof(name), "pause-%dus", target);
+    snprintf(extra, sizeof(extra), ", \"target_ms\": %.3f", target / 1e3);
+    return report(name, pauses[0], extra)*1e3 <= target;
+}
+
+// Reports how long full collections of a big heap spend marking and
+// sweeping with --gc-threads threads. bench/gcthreads.lisp prints the
+// two, in microseconds.
+void
+runthreads(char *eval, int threads)
+{
+    char arg[32];
+    snprintf(arg, sizeof(arg), "%d", threads);
+    char *args[] = {"--gc-threads", arg, NULL};
+    double times[2][runs];
+
+    runnumbers(eval, "bench/gcthreads.lisp", args, 2, times);
+    for (int i = 0; i < runs; i++) {
+        times[0][i] /= 1e3;
+        times[1][i] /= 1e3;
+    }
+
+    char name[32], extra[64];
+    snprintf(extra, sizeof(extra), ", \"threads\": %d", threads);
+    snprintf(name, sizeof(name), "gc-mark-%dt", threads);
+    report(name, times[0], extra);
+    snprintf(name, sizeof(name), "gc-sweep-%dt", threads);
+    report(name, times[1], extra);
+}
+
+#define NALLOCS 200000
+
+// Allocates objects of assorted sizes and drops them, so the collector
+// runs every so often and the sweep frees them in their pages' bitmaps.
+// The allocator has no free that can be called directly: objects are
+// only given back by the sweep.
+void
+microgcmalloc(void)
+{
+    for (int i = 0; i < NALLOCS; i++) {
+        gcmalloc(16 + (i*37)%512);
+    }
+    gc();
+}
+
+#define NNAMES 50000
+
+// New symbols the first time through, lookups after that.
+void
+microintern(void)
+{
+    char name[32];
+
+    for (int round = 0; round < 4; round++) {
+        for (int i = 0; i < NNAMES; i++) {
+            snprintf(name, sizeof(name), "bench-symbol-%d", i);
+            intern(name);
+        }
+    }
+}
+
+Micro micros[] = {
+    {"gcmalloc", microgcmalloc},
+    {"intern", microintern},
+};
+
+int
+main(int argc, char *argv[])
+{
+    gcinit();
+    nurseryinit();
+
+    int checkpauses = 0;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i+1 < argc && atoi(argv[i+1]) > 0) {
+            runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--check-pauses") == 0) {
+            checkpauses = 1;
+        } else {
+            break;
+        }
+    }
+
+    if (i != argc-1) {
+        fprintf(stderr, "usage: %s [-n runs] [--check-pauses] eval\n", argv[0]);
+        exit(1);
+    }
+    char *eval = argv[i];
+
+    printf("{\n  \"runs\": %d,\n  \"benchmarks\": [", runs);
+
+    for (size_t j = 0; j < sizeof(workloads)/sizeof(workloads[0]); j++) {
+        runworkload(eval, &workloads[j]);
+    }
+
+    int ok = 1;
+    for (size_t j = 0; j < sizeof(pausetargets)/sizeof(pausetargets[0]); j++) {
+        if (!runpause(eval, pausetargets[j]) && checkpauses) {
+            fprintf(stderr, "bench: pauses over %dus\n", pausetargets[j]);
+            ok = 0;
+        }
+    }
+
+    // gcinit set gcthreads to the number of CPUs
+    int ncpu = gcthreads;
+    for (int n = 1; n < ncpu; n *= 2) {
+        runthreads(eval, n);
+    }
+    runthreads(eval, ncpu);
+
+    for (size_t j = 0; j < sizeof(micros)/sizeof(micros[0]); j++) {
+        double times[runs];
+
+        for (int k = 0; k < runs; k++) {
+            double start = nowms();
+            micros[j].fn();
+            times[k] = nowms() - start;
+        }
+
+        report(micros[j].name, times, "");
+    }
+
+    printf("\n  ]\n}\n");
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,29 @@
+(def iota (n acc)
+    (if (= n 0)
+        acc
+        (iota (- n 1) (cons n acc))))
+
+(def stat (k l)
+    (if (eq? (caar l) k)
+        (cdr (car l))
+        (stat k (cdr l))))
+
+; About 100MB that stays live, so from here on each full collection
+; has plenty to mark, and is done on gcthreads threads.
+(nil? (def live (iota 6000000 nil)))
+(def mark (stat 'mark-us (gc-stats)))
+(def sweep (stat 'sweep-us (gc-stats)))
+
+; Garbage, so there are collections, and a sweep that frees things.
+(def churn (i garbage)
+    (if (= i 0)
+        nil
+        (churn (- i 1) (iota 1000 nil))))
+
+(churn 6000 nil)
+(length live)
+
+; The time the collections since took, which bench reads as the last
+; two numbers printed.
+(- (stat 'mark-us (gc-stats)) mark)
+(- (stat 'sweep-us (gc-stats)) sweep)
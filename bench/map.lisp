@@ -0,0 +1,16 @@
+(def iota (n acc)
+    (if (= n 0)
+        acc
+        (iota (- n 1) (cons n acc))))
+
+(def sum (l acc)
+    (if (nil? l)
+        acc
+        (sum (cdr l) (+ acc (car l)))))
+
+(def run (i acc)
+    (if (= i 0)
+        acc
+        (run (- i 1) (+ acc (sum (map (fn (x) (* x 2)) (iota 10000 nil)) 0)))))
+
+(run 50 0)
@@ -0,0 +1,28 @@
+; Counts the solutions to the n queens problem. placed holds the rows
+; of the queens in the columns so far, nearest column first.
+
+(def safe? (row dist placed)
+    (if (nil? placed)
+        t
+        (if (= (car placed) row)
+            nil
+            (if (= (car placed) (+ row dist))
+                nil
+                (if (= (car placed) (- row dist))
+                    nil
+                    (safe? row (+ dist 1) (cdr placed)))))))
+
+(def queens (n col placed)
+    (if (= col n)
+        1
+        (tryrows n col 0 placed)))
+
+(def tryrows (n col row placed)
+    (if (= row n)
+        0
+        (+ (if (safe? row 1 placed)
+               (queens n (+ col 1) (cons row placed))
+               0)
+           (tryrows n col (+ row 1) placed))))
+
+(queens 10 0 nil)
@@ -0,0 +1,23 @@
+(def take (l n)
+    (if (= n 0)
+        nil
+        (cons (car l) (take (cdr l) (- n 1)))))
+
+; Keeps about 400 lists of 1000 alive, and replaces the oldest 100 at
+; a time, so most of the garbage is in the old generation.
+(def churn (i k live)
+    (if (= i 0)
+        (length live)
+        (if (= k 0)
+            (churn (- i 1) 100 (take live 400))
+            (churn (- i 1) (- k 1) (cons (repeat i 1000) live)))))
+
+(churn 20000 100 nil)
+
+; The longest pause, which bench reads as the last number printed.
+(def stat (k l)
+    (if (eq? (caar l) k)
+        (cdr (car l))
+        (stat k (cdr l))))
+
+(stat 'max-cpu-pause-us (gc-stats))
@@ -0,0 +1,15 @@
+(def row (n)
+    (list n (- 0 n) 'sym "str" (cons n n)))
+
+(def rows (n acc)
+    (if (= n 0)
+        acc
+        (rows (- n 1) (cons (row n) acc))))
+
+(def big (rows 100000 nil))
+
+big
+big
+big
+big
+big
@@ -0,0 +1,9 @@
+(def template (x l)
+    `(a (b ,x (c ,@l (d ,x ,@l (e ,(+ x 1) (f ,@(cdr l) (g ,(car l)))))))))
+
+(def run (i acc)
+    (if (= i 0)
+        acc
+        (run (- i 1) (template i '(1 2 3 4)))))
+
+(run 100000 nil)
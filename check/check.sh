@@ -0,0 +1,47 @@
+#!/bin/sh
+# Runs each program under the bytecode VM and under --tree-walk, with
+# the default, incremental and single and multi-threaded collectors,
+# and fails if any run's output or exit status differs from the VM's
+# with the default flags.
+#
+# usage: check/check.sh eval
+#
+# The programs are bench/*.lisp and the edge cases in check. Run it
+# from the top of the tree, where eval finds lib.lisp.
+# bench/pause.lisp and bench/gcthreads.lisp are left out because they
+# print timings.
+
+eval=$1
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+unset LC_GCSTATS
+
+# run flags program out
+run() {
+    "$eval" $1 < "$2" > "$3" 2> "$tmp/stderr"
+    echo "exit $?" >> "$3"
+    cat "$tmp/stderr" >> "$3"
+}
+
+fail=0
+for f in bench/*.lisp check/*.lisp; do
+    case "$f" in
+    bench/pause.lisp|bench/gcthreads.lisp)
+        continue
+        ;;
+    esac
+
+    run "" "$f" "$tmp/want"
+    for flags in "--tree-walk" "--gc-pause 200" "--tree-walk --gc-pause 200" "--gc-threads 1" "--tree-walk --gc-threads 4"; do
+        run "$flags" "$f" "$tmp/got"
+        if cmp -s "$tmp/want" "$tmp/got"; then
+            echo "ok   $f $flags"
+        else
+            echo "FAIL $f $flags"
+            diff "$tmp/want" "$tmp/got" | head -20
+            fail=1
+        fi
+    done
+done
+
+exit $fail
@@ -0,0 +1,77 @@
+; Cases where the VM and the tree-walker have separate code paths.
+
+; Fixnums up to the edges of their range, without overflowing.
+(def max 4611686018427387903)
+(def min (- 0 max 1))
+max
+min
+(+ max 0)
+(- min 0)
+(- max max)
+(+ min max)
+(* 2147483648 2147483647)
+(/ min 2)
+(- 0 max)
+
+; Tail calls, deep enough that they only work in constant space.
+(def count (n acc)
+    (if (= n 0)
+        acc
+        (count (- n 1) (+ acc 1))))
+(count 1000000 0)
+
+(def even (n) (if (= n 0) t (odd (- n 1))))
+(def odd (n) (if (= n 0) nil (even (- n 1))))
+(even 100001)
+(odd 100001)
+
+; Varargs.
+(list)
+(list 1 2 3)
+(def rest (a . r) r)
+(rest 1)
+(rest 1 2 3)
+((fn (a b . r) (list a b r)) 1 2)
+((fn (a b . r) (list a b r)) 1 2 3 4)
+((fn args args) 'x 'y)
+(+)
+(+ 1 2 3 4 5)
+(< 1 2 3)
+(< 1 3 2)
+
+; set of captured variables, seen by every closure sharing the frame.
+(def counter ()
+    ((fn (n)
+        (list (fn () (set n (+ n 1)))
+              (fn () n)))
+     0))
+(def c (counter))
+((car c))
+((car c))
+((cadr c))
+(def d (counter))
+((car d))
+((cadr c))
+((cadr d))
+
+(def adder (n) (fn (x) (set n (+ n x)) n))
+(def a (adder 10))
+(a 1)
+(a 2)
+
+; set of a parameter in a tail call.
+(def loop (i acc)
+    (set acc (cons i acc))
+    (if (= i 0) acc (loop (- i 1) acc)))
+(loop 5 nil)
+
+; set of a car or cdr picked by an if.
+(def pick (x y) (set (if (= x 0) (car y) (= x 1) (cdr y) (car y)) 9) y)
+(pick 0 (cons 1 2))
+(pick 1 (cons 1 2))
+(pick 2 (cons 1 2))
+
+; Macros, quasiquote and let.
+(let ((x 1) (y 2)) (list x y))
+(let* ((x 1) (y (+ x 1))) `(,x ,y ,@(list x y)))
+(letrec ((f (fn (n) (if (= n 0) 'done (f (- n 1)))))) (f 10000))
@@ -0,0 +1,22 @@
+; A heap big enough to be marked and swept on several threads, with a
+; vector of lists that keeps changing while it's collected.
+(def iota (n acc)
+    (if (= n 0)
+        acc
+        (iota (- n 1) (cons n acc))))
+
+(def sum (l acc)
+    (if (nil? l)
+        acc
+        (sum (cdr l) (+ acc (car l)))))
+
+(nil? (def big (iota 5000000 nil)))
+
+(def churn (i live)
+    (if (= i 0)
+        live
+        (churn (- i 1) (cons (iota 1000 nil) (if (pair? live) (cdr live) nil)))))
+
+(length (churn 4000 (repeat nil 100)))
+(sum big 0)
+(length big)
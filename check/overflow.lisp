@@ -0,0 +1,7 @@
+; Overflow ends the program, and has to do it at the same point in
+; both, here inside a call.
+(def max 4611686018427387903)
+(def inc (n) (+ n 1))
+(inc (- max 1))
+(inc max)
+'unreached
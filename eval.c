@@ -1,10 +1,23 @@
 #include <assert.h>
 #include <errno.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <float.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 
 void *
 xalloc(size_t size)
@@ -29,1401 +42,6550 @@ xrealloc(void *p, size_t size)
     return p;
 }
 
-typedef struct Header Header;
-struct Header {
-    Header *next; // the least significant bit is the mark bit
-    size_t size; // size in multiples of sizeof(Header)
-};
+typedef struct Value Value;
 
 typedef struct Root Root;
 struct Root {
-    Header *h;
+    void **p; // the variable holding the root, not the root itself
     Root *next;
 };
 
-Header base; // initialized to zero
-Header *freep = &base; // circular linked list
-Header *usedp;         // circular linked list
 Root *roots;           // non-circular
 void *stacktop;
 
-void
-gcinit0(void)
+// The heap. Objects up to LARGEMAX bytes live in HPAGESIZE pages, each
+// holding objects of a single size class. Pages are cut out of SEGSIZE
+// segments, which are mmap'd and aligned to their size, so the segment
+// a pointer is in is found by masking off its low bits. Which objects
+// on a page are allocated, and which are marked, is kept in bitmaps in
+// the page's descriptor, off to the side. Allocating and sweeping only
+// look at the bitmaps, never at the objects. Pages left empty by a
+// sweep are given back to the OS with madvise and can be reused by any
+// size class. Larger objects are mapped one at a time, and unmapped
+// when they die.
+
+#define SEGSIZE (4*1024*1024)
+#define HPAGESIZE (16*1024)
+#define SEGPAGES (SEGSIZE/HPAGESIZE)
+#define MAXOBJS (HPAGESIZE/16) // of the smallest size class
+#define LARGEMAX 2048
+#define OSPAGE 4096
+#define MINHEAP (1024*1024)
+#define NOCLASS (-1)
+
+typedef struct HPage HPage;
+struct HPage {
+    char *base;
+    int class; // or NOCLASS if the page is free
+    size_t size; // of each object
+    size_t nobjs;
+    size_t cursor; // allocation resumes from this word of alloc
+    HPage *next; // in its class's partly free pages, freepages or emptypages
+    uint64_t alloc[MAXOBJS/64];
+    uint64_t marks[MAXOBJS/64];
+    uint32_t *sites; // by object, for the heap profiler; see tagsite
+};
+
+typedef struct Segment Segment;
+struct Segment {
+    char *base;
+    HPage pages[SEGPAGES];
+};
+
+typedef struct Large Large;
+struct Large {
+    char *start;
+    size_t size; // as asked for
+    size_t mapped;
+    int marked;
+    uint32_t site;
+};
+
+typedef struct SizeClass SizeClass;
+struct SizeClass {
+    size_t size;
+    HPage *cur; // the page being allocated from
+    HPage *partial; // other pages with free objects
+    HPage *unswept; // pages that haven't been swept since marking
+};
+
+// Pairs and strings are 16 bytes, locals 24, builtins 32, symbols 48
+// and functions 56 (see typesizes), and Envs are 16 plus 8 per slot,
+// so the small sizes all have classes of their own.
+size_t classsizes[] = {
+    16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256,
+    320, 384, 448, 512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+};
+#define NCLASSES (sizeof(classsizes)/sizeof(classsizes[0]))
+
+SizeClass classes[NCLASSES];
+uint8_t sizeclass[LARGEMAX/8+1]; // by size in words, rounded up
+
+Segment **segs; // sorted by base
+size_t nsegs;
+HPage *freepages;
+HPage *emptypages; // freed, but not given back to the OS yet
+
+// Sorted by start at the start of each collection, so conservative
+// pointers can be found with a binary search. Ones mapped while an
+// incremental collection is marking are appended past nsorted, and
+// are marked already.
+Large *larges;
+size_t nlarges;
+size_t largescap;
+size_t nsorted;
+
+size_t heapsize; // how big the heap can get before the next collection
+size_t heapused; // bytes in pages and large objects that are in use
+
+typedef struct Span Span;
+struct Span {
+    void *start;
+    void *end;
+};
+
+typedef struct MarkStack MarkStack;
+struct MarkStack {
+    Span *spans;
+    size_t n;
+    size_t cap;
+};
+
+// Marked objects whose contents haven't been scanned yet. An explicit
+// stack keeps long lists from overflowing the C stack during marking.
+// Each marker thread pushes onto its own.
+MarkStack mainstack;
+__thread MarkStack *markstack = &mainstack;
+
+int parmarking; // marker threads are running, so mark bits are set atomically
+
+int gcing; // set while collecting, so promotion can't start another collection
+int needgc; // the heap ran out while collecting
+int heapprof; // --heap-profile, see tagsite
+
+#define MAXMARKERS 64
+int gcthreads; // --gc-threads, defaulting to the number of CPUs. See gcparallel
+
+// Incremental collection, turned on by --gc-pause. Marking starts once
+// the heap is three quarters full, and is done a little at a time, in
+// a gcstep after every STEPBYTES allocated. It is snapshot at the
+// beginning: the roots are all marked when it starts, gcwrite marks
+// whatever a store overwrites, and objects allocated in the meantime
+// are marked as they're made. So nothing that was reachable when
+// marking started can be missed, and the stack and the VM's registers
+// never need scanning again.
+//
+// Each step scans markrate bytes for every byte allocated since the
+// last, which is enough to mark the whole heap before the rest of it
+// fills up, but stops at pausetarget seconds regardless. If marking
+// falls behind, the heap grows rather than the collection being
+// finished in one go. The sweep is lazy: gcfinish only queues each
+// class's pages, and they're swept by smallalloc when it needs one, and
+// by the steps that follow. The nursery is kept small enough that
+// minor collections fit in the target too, see minorgc, though not for
+// targets much under a millisecond, since it has a minimum size.
+#define STEPBYTES (64*1024)
+#define SCANCHUNK (4*1024) // of a big object, scanned per span popped
+#define LAZYSWEEP 16 // pages swept by smallalloc before it takes a new one
+#define NPAUSES 24
+#define RELEASEPAGES 32 // per collection, since madvise is slow
+
+int incremental;
+int marking; // between gcstart and gcfinish
+int sweeping; // from gcfinish until every page has been swept
+double pausetarget;
+size_t markcredit; // bytes allocated since the last gcstep
+double markrate;
+double markdebt; // bytes still to scan
+size_t torelease; // empty pages still to give back this collection
+
+// Counters for (gc-stats), and for the summary printed at exit if
+// LC_GCSTATS is set. Times are in seconds.
+typedef struct GCStats GCStats;
+struct GCStats {
+    size_t mallocs; // gcmalloc calls, including the ones alloc makes
+    size_t mallocbytes;
+    size_t grows; // times heapsize went up
+    size_t gcs;
+    size_t minorgcs; // not counting the one each gc starts with
+    size_t reclaimed; // bytes freed by major collections
+    size_t released; // bytes given back to the OS
+    size_t promoted; // objects copied out of the nursery
+    size_t pinned; // nursery pages promoted in place
+    size_t parallel; // collections marked by more than one thread
+    size_t steps; // of incremental marking
+    size_t arenabytes; // allocated in the expansion arena
+    size_t arenaescapes; // slots outside the arena that arenaexit had to repoint
+    double gctime; // in gc, including the minor collection it starts with
+    double minortime; // in other minor collections
+    double marktime; // in gc marking, the part gcthreads share
+    double sweeptime; // in gc sweeping and giving pages back
+    double maxpause;
+    double maxcpupause; // not counting time the OS gave to other processes
+    size_t pauses[NPAUSES]; // pauses[i] counts the ones under 2^i us
+};
+GCStats gcstats;
+
+double now(void);
+double cputime(void);
+
+// Counts what the program has done that outlives the call doing it:
+// defs, sets of anything but a slot in the running frame, and prints.
+// load compares it before and after expanding a form, see expandform.
+size_t effects;
+
+// Expanding and resolving a top level form makes a lot of garbage: the
+// copies expandlist makes of every form, and the frames, argument lists
+// and closures of the macros it calls. While expanding is set, pairs,
+// frames and closures come from the expansion arena instead of the
+// heap. Once the form is done, arenaexit copies what's still wanted
+// out to the heap, and frees the rest of the arena at once.
+//
+// What's wanted is the result, and whatever a slot outside the arena
+// was pointed at meanwhile, e.g. by a macro that sets a global. gcwrite
+// puts those slots on arenaslots, and so do cons, mkframe and mkfunc
+// when the arena is full and they've had to use the heap. The copies
+// are made with forwarding, so anything shared stays shared, and the
+// slots are pointed at them.
+//
+// Until then, the collectors treat arena objects much like heap ones.
+// A slot in the arena that points into the nursery is remembered, and
+// gcmark finds the object an arena pointer is into from arenastarts,
+// which has a bit for the first 16 byte unit of each, and marks it in
+// arenamarks. arenaslots are roots, so the objects they're in are kept
+// until the copy is made. A file loaded by a macro is expanded on the
+// heap, since the arena is taken.
+#define ARENASIZE (64*1024*1024)
+#define ARENAKEEP (4*1024*1024) // of it kept resident after a form, see arenaexit
+#define ARENAENV 1 // on a slot in arenaslots that holds an Env *
+
+int expanding;
+int arenadepth; // of arenaenter calls, only the outermost of which uses the arena
+char *arena;
+size_t arenaused;
+uint64_t *arenastarts;
+uint64_t *arenamarks;
+void **arenafwd; // the copy arenaexit made of each object, by 16 byte unit
+uintptr_t *arenaslots; // outside the arena, pointing into it
+size_t narenaslots;
+size_t arenaslotscap;
+
+int
+inarena(void *p)
 {
-    freep->next = freep;
+    return (uintptr_t)p - (uintptr_t)arena < arenaused;
 }
 
-#define gcinit() do { void *x; stacktop = &x; gcinit0(); } while(0)
+void *
+arenamap(size_t size)
+{
+    void *p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return p;
+}
 
-// TOOD: gcroot won't work for symtab, because intern does; symtab = cons("foo", symtab)
-void
-gcroot(void *p)
+// Returns NULL if the arena is full, and the caller makes do with the
+// heap.
+void *
+arenaalloc(size_t size)
 {
-    Header *h = (Header *)p-1;
-    Root *r = xalloc(sizeof(Root));
+    size = (size + 15) & ~(size_t)15;
 
-    r->h = h;
-    r->next = roots;
-    roots = r;
+    if (arena == NULL) {
+        arena = arenamap(ARENASIZE);
+        arenafwd = arenamap(ARENASIZE/16*sizeof(void *));
+        arenastarts = arenamap(ARENASIZE/16/8);
+        arenamarks = arenamap(ARENASIZE/16/8);
+    }
+
+    if (arenaused + size > ARENASIZE) {
+        return NULL;
+    }
+
+    // like the heap's, objects made while marking are marked
+    size_t i = arenaused/16;
+    arenastarts[i/64] |= 1ull << i%64;
+    if (marking) {
+        arenamarks[i/64] |= 1ull << i%64;
+    }
+
+    void *p = arena + arenaused;
+    arenaused += size;
+    gcstats.arenabytes += size;
+    memset(p, 0, size);
+    return p;
 }
 
+// Adds slot, which is outside the arena and points into it, to
+// arenaslots. tag is ARENAENV if it holds an Env *.
 void
-gcmark(void *p)
+arenaslot(void *slot, uintptr_t tag)
 {
+    if (narenaslots == arenaslotscap) {
+        arenaslotscap = arenaslotscap ? arenaslotscap*2 : 64;
+        arenaslots = xrealloc(arenaslots, arenaslotscap*sizeof(uintptr_t));
+    }
+    arenaslots[narenaslots++] = (uintptr_t)slot | tag;
 }
 
 void
-gcmarkall(void)
+gcinit0(void)
 {
+    for (size_t i = 0, c = 0; i <= LARGEMAX/8; i++) {
+        if (i*8 > classsizes[c]) {
+            c++;
+        }
+        sizeclass[i] = c;
+    }
+
+    for (size_t c = 0; c < NCLASSES; c++) {
+        classes[c].size = classsizes[c];
+    }
+
+    heapsize = MINHEAP;
 
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    gcthreads = ncpu < 1 ? 1 : ncpu > MAXMARKERS ? MAXMARKERS : ncpu;
 }
 
+// __builtin_frame_address(0) is above all of main's locals, so values
+// that only live in main's frame are still seen by the stack scan.
+#define gcinit() do { stacktop = __builtin_frame_address(0); gcinit0(); } while(0)
+
+// Registers the address of a variable rather than the object it points
+// to, so the variable can be reassigned (or point into the nursery and
+// be updated when its object moves) and the collector still sees it.
 void
-gcsweep(void)
+gcroot(void *p)
 {
+    Root *r = xalloc(sizeof(Root));
 
+    r->p = p;
+    r->next = roots;
+    roots = r;
 }
 
-void
-gc()
+// Returns the segment containing p, or NULL.
+Segment *
+segfind(void *p)
 {
-    gcmarkall();
-    gcsweep();
+    char *base = (char *)((uintptr_t)p & ~(uintptr_t)(SEGSIZE-1));
+    size_t lo = 0, hi = nsegs;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+
+        if (segs[mid]->base < base) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo < nsegs && segs[lo]->base == base ? segs[lo] : NULL;
 }
 
-void
-gcfree(Header *h)
+// Returns the large object containing p, or NULL.
+Large *
+largefind(void *p)
 {
-    Header *p = freep;
-
-    while (1) {
-        if (p <= h && p->next >= h+h->size) {
-            // if h abuts p->next, merge them
-            if (h+h->size == p->next) {
-                h->size += p->next->size;
-                h->next = p->next->next;
-            } else {
-                h->next = p->next;
-            }
+    size_t lo = 0, hi = nsorted;
 
-            // if p abuts h, merge them too
-            if (p+p->size == h) {
-                p->size += h->size;
-                p->next = h->next;
-            } else {
-                p->next = h;
-            }
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
 
-            freep = p;
-            return;
+        if ((void *)larges[mid].start <= p) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
+    }
 
-        p = p->next;
+    // larges[lo-1] is the last one starting at or before p
+    if (lo > 0 && p < (void *)(larges[lo-1].start + larges[lo-1].size)) {
+        return &larges[lo-1];
     }
-}
 
-#define MIN_ALLOC 4096
+    return NULL;
+}
 
 void
-gcmore(size_t size)
+gcpush(void *start, void *end)
 {
-    if (size < MIN_ALLOC) {
-        size = MIN_ALLOC;
-    }
+    MarkStack *ms = markstack;
 
-    assert(size%sizeof(Header) == 0);
+    if (ms->n == ms->cap) {
+        ms->cap = ms->cap ? ms->cap*2 : 1024;
+        ms->spans = xrealloc(ms->spans, ms->cap*sizeof(Span));
+    }
+    ms->spans[ms->n].start = start;
+    ms->spans[ms->n].end = end;
+    ms->n++;
+}
 
-    // we may need to use aligned_alloc here
-    Header *p = xalloc(size);
+// Sets bit in *w. Returns 1 if it wasn't set already, in which case
+// the caller has to push the object.
+int
+setmark(uint64_t *w, uint64_t bit)
+{
+    if (__atomic_load_n(w, __ATOMIC_RELAXED) & bit) {
+        return 0;
+    }
 
-    assert((uintptr_t)p % sizeof(Header) == 0);
+    if (parmarking) {
+        return !(__atomic_fetch_or(w, bit, __ATOMIC_RELAXED) & bit);
+    }
 
-    gcfree(p);
+    *w |= bit;
+    return 1;
 }
 
-void *
-gcmalloc(size_t size)
+int nurserymark(void *p);
+void vmroots(void (*f)(Value **));
+
+// Called by gcmark. Returns 1 if p points into the arena, whether or
+// not it marked anything.
+int
+arenamark(void *p)
 {
-    size_t nhead = (sizeof(Header) + size - 1) / sizeof(Header) + 1;
+    if (!inarena(p)) {
+        return 0;
+    }
 
-    Header *prev = freep;
-    Header *p = freep->next;
+    // the object starts at the last start bit at or before p's unit,
+    // and runs up to the next one
+    size_t i = ((char *)p - arena)/16, n = arenaused/16;
+    while (!(arenastarts[i/64] >> i%64 & 1)) {
+        i--;
+    }
+    if (!setmark(&arenamarks[i/64], 1ull << i%64)) {
+        return 1;
+    }
 
-    int gcd = 0;
+    size_t j = i+1;
+    while (j < n && !(arenastarts[j/64] >> j%64 & 1)) {
+        j++;
+    }
+    gcpush(arena + i*16, arena + j*16);
+    return 1;
+}
 
-    while (1) {
-        if (p->size >= nhead) {
-            if (p->size == nhead) {
-                prev->next = p->next;
-            } else {
-                p->size -= nhead;
-                p += p->size;
-                p->size = nhead;
-            }
+// Interior pointers count, e.g. the &topair(p)->car returned by
+// evalslot, and the tagged pointers to pairs themselves.
+void
+gcmark(void *p)
+{
+    if (nurserymark(p) || arenamark(p)) {
+        return;
+    }
 
-            if (usedp == NULL) {
-                usedp = p->next = p;
-            } else {
-                p->next = usedp->next;
-                usedp->next = p;
-            }
+    Segment *s = segfind(p);
 
-            return p+1;
+    if (s != NULL) {
+        HPage *pg = &s->pages[((char *)p - s->base) / HPAGESIZE];
+        if (pg->class == NOCLASS) {
+            return;
         }
 
-        if (p == freep && !gcd) {
-            gc();
-            gcd = 1;
-        } else if (p == freep) {
-            gcmore(nhead*sizeof(Header));
+        size_t i = ((char *)p - pg->base) / pg->size;
+        uint64_t bit = 1ull << i%64;
+
+        if (i >= pg->nobjs || !(pg->alloc[i/64] & bit) || !setmark(&pg->marks[i/64], bit)) {
+            return;
         }
 
-        prev = p;
-        p = p->next;
+        char *start = pg->base + i*pg->size;
+        gcpush(start, start + pg->size);
+        return;
+    }
+
+    Large *l = largefind(p);
+
+    if (l != NULL && !__atomic_load_n(&l->marked, __ATOMIC_RELAXED) && !__atomic_exchange_n(&l->marked, 1, __ATOMIC_RELAXED)) {
+        gcpush(l->start, l->start + l->size);
     }
 }
 
+// Conservatively marks every word in [start, end).
+void
+gcscan(void *start, void *end)
+{
+    uintptr_t a = ((uintptr_t)start + sizeof(void *) - 1) & ~(uintptr_t)(sizeof(void *) - 1);
 
-enum Type {
-    SYMBOL,
-    STRING,
-    INTEGER,
-    PAIR,
-    BUILTIN,
-    FUNCTION,
-    MACRO,
-};
-typedef enum Type Type;
+    for (void **w = (void **)a; (void *)(w+1) <= end; w++) {
+        gcmark(*w);
+    }
+}
 
-typedef struct Value Value;
+// Kept out of line so that its frame is below gcmarkroots's, and the
+// registers spilled by setjmp there are covered by the scan.
+__attribute__((noinline)) void
+gcscanstack(void)
+{
+    void *sp = &sp;
+    gcscan(sp, stacktop);
+}
 
-struct Buf {
-    char *s;
-    size_t len;
-    size_t cap;
-};
-typedef struct Buf Buf;
+void
+gcmarkslot(Value **p)
+{
+    gcmark(*p);
+}
 
-struct Pair {
-    Value *car;
-    Value *cdr;
-};
-typedef struct Pair Pair;
+int
+largecmp(const void *a, const void *b)
+{
+    const Large *x = a, *y = b;
+    return (x->start > y->start) - (x->start < y->start);
+}
 
-typedef struct Env Env;
-struct Env {
-    Env *parent;
-    Value *bindings;
-};
+void
+gcmarkroots(void)
+{
+    qsort(larges, nlarges, sizeof(Large), largecmp);
+    nsorted = nlarges;
 
-struct Func {
-    Value *name;
-    Value *params;
-    Value *body;
-    Env *env;
-};
-typedef struct Func Func;
+    for (Root *r = roots; r != NULL; r = r->next) {
+        gcmark(*r->p);
+    }
+    vmroots(gcmarkslot);
 
-typedef Value *(*Imp)(Value *args);
+    // The arena isn't swept, so its marks are cleared here. The objects
+    // holding arenaslots have to stay until arenaexit has repointed them.
+    if (arena != NULL) {
+        memset(arenamarks, 0, (arenaused/16 + 63)/64*sizeof(uint64_t));
+    }
+    for (size_t i = 0; i < narenaslots; i++) {
+        gcmark((void *)(arenaslots[i] & ~(uintptr_t)ARENAENV));
+    }
 
-struct Builtin {
-    char *name;
-    Imp imp;
+    jmp_buf regs;
+    setjmp(regs);
+    gcscanstack();
+}
+
+// Pages swept by one thread, to be joined onto the real lists after.
+// The tails are kept so joining doesn't have to walk them.
+typedef struct Sweep Sweep;
+struct Sweep {
+    HPage *partial[NCLASSES];
+    HPage *partialtail[NCLASSES];
+    HPage *empty;
+    HPage *emptytail;
+    size_t nempty;
+    size_t freed;
 };
-typedef struct Builtin Builtin;
 
-struct Value {
-    Type type;
-    union {
-        char *sym;
-        Buf *str;
-        long long n;
-        Pair pair;
-        Builtin builtin;
-        Func func; // also used for macros
-    };
+// Big heaps are marked and swept by gcthreads threads, the collecting
+// one included. Each marker marks from its own local stack, and moves
+// spans to its shared stack when it has plenty, for markers that have
+// run out to steal. Sweeping hands out segments one at a time. The
+// other threads are started the first time they're needed, and wait
+// for the next job in between.
+#define PARALLELMIN (64*1024*1024) // of heapused; smaller heaps are quicker on one thread
+#define STEALBATCH 64
+
+typedef struct Marker Marker;
+struct Marker {
+    MarkStack local;
+    pthread_mutex_t lock; // of shared
+    MarkStack shared;
+    Sweep sweep;
+    size_t gen; // of the last job started
+    unsigned seed;
 };
 
-// s_nil can never appear in lisp land. It is read as NULL (empty list);
-Value *s_nil;
+Marker markers[MAXMARKERS];
+int nmarkers; // started, counting the collecting thread
 
-Value *s_t;
-Value *t; // s_t
-Value *s_fn;
-Value *s_macro;
-Value *s_quote;
-Value *s_quasiquote;
-Value *s_unquote;
-Value *s_unquote_splicing;
-Value *s_if;
-Value *s_def;
-Value *s_set;
-Value *s_car;
-Value *s_cdr;
+pthread_mutex_t parlock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t parstart = PTHREAD_COND_INITIALIZER;
+pthread_cond_t pardone = PTHREAD_COND_INITIALIZER;
+void (*parjob)(Marker *);
+size_t pargen; // bumped for each job
+int parbusy; // threads still working on it, not counting the collecting one
 
-Buf *
-binit(char *s)
+int idlemarkers;
+size_t nextseg; // to be swept
+
+void *markerthread(void *arg);
+
+void
+startmarkers(void)
 {
-    Buf *b = xalloc(sizeof(Buf));
-    b->len = strlen(s);
-    b->cap = b->len + 1;
-    b->s = xalloc(b->cap);
-    strncpy(b->s, s, b->len);
-    return b;
+    if (nmarkers == 0) {
+        pthread_mutex_init(&markers[0].lock, NULL);
+        markers[0].seed = 1;
+        nmarkers = 1;
+    }
+
+    for (; nmarkers < gcthreads; nmarkers++) {
+        Marker *m = &markers[nmarkers];
+        pthread_t t;
+
+        pthread_mutex_init(&m->lock, NULL);
+        m->gen = pargen;
+        m->seed = nmarkers+1;
+
+        if (pthread_create(&t, NULL, markerthread, m) != 0) {
+            gcthreads = nmarkers;
+            break;
+        }
+        pthread_detach(t);
+    }
 }
 
-Buf *
-bappend(Buf *b, char *s)
+// Whether this collection should use the marker threads, which are
+// started if it's the first one that does.
+int
+gcparallel(void)
 {
-    size_t len = strlen(s);
-    if (b->len + len + 1 > b->cap) {
-        b->cap = b->len + len + 1;
-        b->s = xrealloc(b->s, b->cap);
+    if (gcthreads <= 1 || heapused < PARALLELMIN) {
+        return 0;
     }
-    strncpy(b->s + b->len, s, len);
-    b->len += len;
-    return b;
+
+    startmarkers();
+    return gcthreads > 1;
 }
 
-Buf *
-bputc(Buf *b, char c)
+void *
+markerthread(void *arg)
 {
-    if (b->len + 1 > b->cap) {
-        b->cap *= 2;
-        b->s = xrealloc(b->s, b->cap);
+    Marker *m = arg;
+
+    markstack = &m->local;
+
+    pthread_mutex_lock(&parlock);
+    for (;;) {
+        while (m->gen == pargen) {
+            pthread_cond_wait(&parstart, &parlock);
+        }
+        m->gen = pargen;
+        pthread_mutex_unlock(&parlock);
+
+        parjob(m);
+
+        pthread_mutex_lock(&parlock);
+        if (--parbusy == 0) {
+            pthread_cond_signal(&pardone);
+        }
     }
-    b->s[b->len++] = c;
-    return b;
+
+    return NULL;
 }
 
-Value *
-alloc(Type t)
+// Runs job on every marker at once, and waits for them all to finish.
+void
+parallel(void (*job)(Marker *))
 {
-    Value *v = xalloc(sizeof(Value));
-    v->type = t;
-    return v;
+    pthread_mutex_lock(&parlock);
+    parjob = job;
+    parbusy = gcthreads-1;
+    pargen++;
+    pthread_cond_broadcast(&parstart);
+    pthread_mutex_unlock(&parlock);
+
+    markstack = &markers[0].local;
+    job(&markers[0]);
+    markstack = &mainstack;
+
+    pthread_mutex_lock(&parlock);
+    while (parbusy > 0) {
+        pthread_cond_wait(&pardone, &parlock);
+    }
+    pthread_mutex_unlock(&parlock);
 }
 
-int
-is_nil(Value *v) {
-    return v == NULL;
-}
+// Moves up to n spans from the top of from to to.
+void
+movespans(MarkStack *to, MarkStack *from, size_t n)
+{
+    if (n > from->n) {
+        n = from->n;
+    }
 
-int
-is_symbol(Value *v) {
-    return !is_nil(v) && v->type == SYMBOL;
-}
+    if (to->n + n > to->cap) {
+        to->cap = to->n + n > 1024 ? (to->n + n)*2 : 1024;
+        to->spans = xrealloc(to->spans, to->cap*sizeof(Span));
+    }
 
-int
-is_string(Value *v) {
-    return !is_nil(v) && v->type == STRING;
+    memcpy(to->spans + to->n, from->spans + from->n - n, n*sizeof(Span));
+    __atomic_store_n(&to->n, to->n + n, __ATOMIC_RELAXED);
+    __atomic_store_n(&from->n, from->n - n, __ATOMIC_RELAXED);
 }
 
+// Gets m more work, from its own shared stack or by stealing half of
+// someone else's. Returns 0 once every marker has run out, which can't
+// change after, since only a marker with work can share any.
 int
-is_integer(Value *v) {
-    return !is_nil(v) && v->type == INTEGER;
-}
+steal(Marker *m)
+{
+    pthread_mutex_lock(&m->lock);
+    movespans(&m->local, &m->shared, STEALBATCH);
+    pthread_mutex_unlock(&m->lock);
 
-int
-is_pair(Value *v) {
-    return !is_nil(v) && v->type == PAIR;
+    if (m->local.n > 0) {
+        return 1;
+    }
+
+    __atomic_fetch_add(&idlemarkers, 1, __ATOMIC_SEQ_CST);
+
+    for (;;) {
+        int start = rand_r(&m->seed) % gcthreads;
+
+        for (int i = 0; i < gcthreads; i++) {
+            Marker *v = &markers[(start + i) % gcthreads];
+
+            if (v == m || __atomic_load_n(&v->shared.n, __ATOMIC_RELAXED) == 0) {
+                continue;
+            }
+
+            // Only a busy marker's shared stack has anything in it, so
+            // while we hold the lock they can't all be idle.
+            pthread_mutex_lock(&v->lock);
+            if (v->shared.n > 0) {
+                __atomic_fetch_sub(&idlemarkers, 1, __ATOMIC_SEQ_CST);
+                movespans(&m->local, &v->shared, (v->shared.n+1)/2);
+                pthread_mutex_unlock(&v->lock);
+                return 1;
+            }
+            pthread_mutex_unlock(&v->lock);
+        }
+
+        if (__atomic_load_n(&idlemarkers, __ATOMIC_SEQ_CST) == gcthreads) {
+            return 0;
+        }
+        sched_yield();
+    }
 }
 
-int
-is_builtin(Value *v) {
-    return !is_nil(v) && v->type == BUILTIN;
+void
+parmark(Marker *m)
+{
+    do {
+        while (m->local.n > 0) {
+            Span sp = m->local.spans[--m->local.n];
+            gcscan(sp.start, sp.end);
+
+            if (m->local.n > 2*STEALBATCH && __atomic_load_n(&m->shared.n, __ATOMIC_RELAXED) == 0) {
+                pthread_mutex_lock(&m->lock);
+                movespans(&m->shared, &m->local, STEALBATCH);
+                pthread_mutex_unlock(&m->lock);
+            }
+        }
+    } while (steal(m));
 }
 
-int
-is_function(Value *v) {
-    return !is_nil(v) && v->type == FUNCTION;
+void
+gcdrain(void)
+{
+    if (gcparallel() && mainstack.n > 0) {
+        // deal out what the roots marked
+        for (size_t i = 0; i < mainstack.n; i++) {
+            Marker *m = &markers[i % gcthreads];
+            markstack = &m->shared;
+            gcpush(mainstack.spans[i].start, mainstack.spans[i].end);
+        }
+        markstack = &mainstack;
+        mainstack.n = 0;
+
+        idlemarkers = 0;
+        parmarking = 1;
+        parallel(parmark);
+        parmarking = 0;
+        gcstats.parallel++;
+        return;
+    }
+
+    while (mainstack.n > 0) {
+        Span sp = mainstack.spans[--mainstack.n];
+        gcscan(sp.start, sp.end);
+    }
 }
 
-int
-is_procedure(Value *v) {
-    return is_function(v) || is_builtin(v);
+void nurserysweep(void);
+
+// Gives up to max empty pages back to the OS.
+void
+releasepages(size_t max)
+{
+    for (; emptypages != NULL && max > 0; max--) {
+        HPage *pg = emptypages;
+        emptypages = pg->next;
+
+        madvise(pg->base, HPAGESIZE, MADV_DONTNEED);
+        gcstats.released += HPAGESIZE;
+
+        pg->next = freepages;
+        freepages = pg;
+    }
 }
 
-int
-is_macro(Value *v) {
-    return !is_nil(v) && v->type == MACRO;
+// Frees pg's unmarked objects, and adds it to sw's lists if that
+// leaves it partly or completely free.
+void
+sweeppage(HPage *pg, Sweep *sw)
+{
+    size_t before = 0, live = 0;
+    for (size_t w = 0; w < (pg->nobjs+63)/64; w++) {
+        before += __builtin_popcountll(pg->alloc[w]);
+        pg->alloc[w] &= pg->marks[w];
+        pg->marks[w] = 0;
+        live += __builtin_popcountll(pg->alloc[w]);
+    }
+    sw->freed += (before - live)*pg->size;
+
+    if (live == 0) {
+        pg->class = NOCLASS;
+        pg->next = sw->empty;
+        if (sw->empty == NULL) {
+            sw->emptytail = pg;
+        }
+        sw->empty = pg;
+        sw->nempty++;
+    } else if (live < pg->nobjs) {
+        int c = pg->class;
+
+        pg->cursor = 0;
+        pg->next = sw->partial[c];
+        if (sw->partial[c] == NULL) {
+            sw->partialtail[c] = pg;
+        }
+        sw->partial[c] = pg;
+    }
 }
 
-Value *
-car(Value *v)
+void
+sweepsegment(Segment *s, Sweep *sw)
 {
-    if (is_pair(v)) {
-        return v->pair.car;
-    } else {
-        return NULL;
+    for (HPage *pg = s->pages; pg < s->pages + SEGPAGES; pg++) {
+        if (pg->class != NOCLASS) {
+            sweeppage(pg, sw);
+        }
     }
 }
 
-Value *
-cdr(Value *v)
+void
+parsweep(Marker *m)
 {
-    if (is_pair(v)) {
-        return v->pair.cdr;
-    } else {
-        return NULL;
+    Sweep *sw = &m->sweep;
+    size_t i;
+
+    memset(sw, 0, sizeof(Sweep));
+    while ((i = __atomic_fetch_add(&nextseg, 1, __ATOMIC_RELAXED)) < nsegs) {
+        sweepsegment(segs[i], sw);
     }
 }
 
-Value *
-caar(Value *v)
+// Adds what sw found to the partly free and empty page lists. Returns
+// the bytes it freed.
+size_t
+joinsweep(Sweep *sw)
 {
-    return car(car(v));
+    for (size_t c = 0; c < NCLASSES; c++) {
+        if (sw->partial[c] != NULL) {
+            sw->partialtail[c]->next = classes[c].partial;
+            classes[c].partial = sw->partial[c];
+        }
+    }
+
+    if (sw->empty != NULL) {
+        sw->emptytail->next = emptypages;
+        emptypages = sw->empty;
+        heapused -= sw->nempty*HPAGESIZE;
+    }
+
+    return sw->freed;
 }
 
-Value *
-cadr(Value *v)
+Large *deadlarges; // left for sweepstep to unmap
+size_t ndeadlarges;
+size_t deadlargescap;
+
+// Drops the unmarked large objects from larges, and returns the bytes
+// they took. If lazy, they're put on deadlarges rather than unmapped
+// now, since munmap can be slow.
+size_t
+sweeplarges(int lazy)
 {
-    return car(cdr(v));
+    size_t n = 0, sorted = 0, freed = 0;
+
+    for (size_t i = 0; i < nlarges; i++) {
+        Large *l = &larges[i];
+
+        if (l->marked) {
+            l->marked = 0;
+            // the survivors stay in order
+            if (i < nsorted) {
+                sorted++;
+            }
+            larges[n++] = *l;
+            continue;
+        }
+
+        freed += l->mapped;
+        heapused -= l->mapped;
+
+        if (lazy) {
+            if (ndeadlarges == deadlargescap) {
+                deadlargescap = deadlargescap ? deadlargescap*2 : 64;
+                deadlarges = xrealloc(deadlarges, deadlargescap*sizeof(Large));
+            }
+            deadlarges[ndeadlarges++] = *l;
+        } else {
+            munmap(l->start, l->mapped);
+            gcstats.released += l->mapped;
+        }
+    }
+    nlarges = n;
+    nsorted = sorted;
+
+    return freed;
 }
 
-Value *
-cddr(Value *v)
+// Returns the number of bytes reclaimed. Each class's list of partly
+// free pages is rebuilt from scratch.
+size_t
+gcsweep(void)
 {
-    return cdr(cdr(v));
+    size_t freed = 0;
+
+    nurserysweep();
+
+    for (size_t c = 0; c < NCLASSES; c++) {
+        classes[c].cur = classes[c].partial = NULL;
+    }
+
+    if (gcparallel()) {
+        nextseg = 0;
+        parallel(parsweep);
+        for (int i = 0; i < gcthreads; i++) {
+            freed += joinsweep(&markers[i].sweep);
+        }
+    } else {
+        Sweep sw;
+        memset(&sw, 0, sizeof(sw));
+        for (size_t i = 0; i < nsegs; i++) {
+            sweepsegment(segs[i], &sw);
+        }
+        freed += joinsweep(&sw);
+    }
+
+    return freed + sweeplarges(0);
 }
 
-Value *
-cadar(Value *v)
+// Queues every page to be swept by smallalloc and sweepstep, for an
+// incremental collection.
+void
+startsweep(void)
 {
-    return car(cdr(car(v)));
+    nurserysweep();
+
+    for (size_t c = 0; c < NCLASSES; c++) {
+        classes[c].cur = classes[c].partial = classes[c].unswept = NULL;
+    }
+
+    for (size_t i = 0; i < nsegs; i++) {
+        for (HPage *pg = segs[i]->pages; pg < segs[i]->pages + SEGPAGES; pg++) {
+            if (pg->class != NOCLASS) {
+                pg->next = classes[pg->class].unswept;
+                classes[pg->class].unswept = pg;
+            }
+        }
+    }
+
+    gcstats.reclaimed += sweeplarges(1);
+    torelease = RELEASEPAGES;
+    sweeping = 1;
 }
 
-Value *
-caddr(Value *v)
+// Sweeps one of class c's unswept pages.
+void
+sweepone(size_t c)
 {
-    return car(cdr(cdr(v)));
+    Sweep sw;
+    memset(&sw, 0, sizeof(sw));
+
+    HPage *pg = classes[c].unswept;
+    classes[c].unswept = pg->next;
+    sweeppage(pg, &sw);
+
+    gcstats.reclaimed += joinsweep(&sw);
 }
 
-Value *
-cdddr(Value *v)
+void
+gcpause(double t, double cpu)
 {
-    return cdr(cdr(cdr(v)));
+    if (t > gcstats.maxpause) {
+        gcstats.maxpause = t;
+    }
+    if (cpu > gcstats.maxcpupause) {
+        gcstats.maxcpupause = cpu;
+    }
+
+    size_t i = 0;
+    while (i < NPAUSES-1 && t*1e6 >= (double)(1ull << i)) {
+        i++;
+    }
+    gcstats.pauses[i]++;
 }
 
-Value *
-caddar(Value *v)
+// Once everything has been swept.
+void
+gcdone(void)
 {
-    return car(cdr(cdr(car(v))));
+    // If most of the heap is still live, collecting again soon won't
+    // get us much. Grow so that collections stay proportional to
+    // allocation.
+    if (heapused > heapsize/2) {
+        heapsize *= 2;
+        gcstats.grows++;
+    }
+
+    needgc = 0;
+    gcstats.gcs++;
 }
 
-Value *
-cons(Value *car, Value *cdr)
+// Called once marking is done. If lazy, it only starts the sweep, and
+// sweepstep finishes it.
+void
+gcfinish(int lazy)
 {
-    Value *v = alloc(PAIR);
-    v->pair.car = car;
-    v->pair.cdr = cdr;
-    return v;
+    marking = 0;
+
+    if (lazy) {
+        startsweep();
+        return;
+    }
+
+    gcstats.reclaimed += gcsweep();
+    releasepages(SIZE_MAX);
+    gcdone();
 }
 
-Value *
-mkint(long long n)
+// Sweeps, unmaps dead large objects and gives empty pages back until
+// deadline. Returns 1 once there's none of that left, at which point
+// the collection is done.
+int
+sweepstep(double deadline)
 {
-    Value *v = alloc(INTEGER);
-    v->n = n;
-    return v;
+    Sweep sw;
+    memset(&sw, 0, sizeof(sw));
+
+    size_t n = 0;
+    int late = 0;
+    for (size_t c = 0; c < NCLASSES && !late; c++) {
+        while (classes[c].unswept != NULL) {
+            HPage *pg = classes[c].unswept;
+            classes[c].unswept = pg->next;
+            sweeppage(pg, &sw);
+
+            if (++n%32 == 0 && now() >= deadline) {
+                late = 1;
+                break;
+            }
+        }
+    }
+    gcstats.reclaimed += joinsweep(&sw);
+
+    while (!late && ndeadlarges > 0) {
+        Large *l = &deadlarges[--ndeadlarges];
+        munmap(l->start, l->mapped);
+        gcstats.released += l->mapped;
+        late = now() >= deadline;
+    }
+
+    while (!late && torelease > 0 && emptypages != NULL) {
+        releasepages(1);
+        torelease--;
+        late = now() >= deadline;
+    }
+
+    for (size_t c = 0; c < NCLASSES; c++) {
+        if (classes[c].unswept != NULL) {
+            return 0;
+        }
+    }
+    if (ndeadlarges > 0 || (torelease > 0 && emptypages != NULL)) {
+        return 0;
+    }
+
+    sweeping = 0;
+    gcdone();
+    return 1;
 }
 
-Value *
-mkstring(Buf *b)
+void minorgc(void);
+
+// Collects the whole heap, or if an incremental collection is marking,
+// does the rest of it.
+void
+gc()
 {
-    Value *v = alloc(STRING);
-    v->str = b;
-    return v;
+    double start = now(), cpustart = cputime();
+    gcing = 1;
+
+    // The last collection's marks have to be gone before this one's
+    // are set.
+    while (sweeping && !sweepstep(DBL_MAX)) {
+    }
+
+    // Empty the nursery first, unless gcstart already has. Afterwards
+    // nothing in the heap points at a young object, and the remembered
+    // set is empty.
+    double mark = now();
+    if (!marking) {
+        minorgc();
+        mark = now();
+        gcmarkroots();
+    }
+    gcdrain();
+
+    double sweep = now();
+    gcstats.marktime += sweep - mark;
+    gcfinish(0);
+    gcstats.sweeptime += now() - sweep;
+
+    gcing = 0;
+
+    double t = now() - start;
+    gcstats.gctime += t;
+    gcpause(t, cputime() - cpustart);
 }
 
-Value *
-mkfunc(Type type, Value *params, Value *body, Env *env)
+// The first pause of an incremental collection, in which the roots
+// are marked.
+void
+gcstart(void)
 {
-    assert(type == FUNCTION || type == MACRO);
+    double start = now(), cpustart = cputime();
+    gcing = 1;
+
+    minorgc();
+    gcmarkroots();
+    marking = 1;
+    markcredit = 0;
+
+    // Promotion can take the heap past where marking should have
+    // started. Leave a quarter of it to allocate in while marking.
+    if (heapused > heapsize/4*3) {
+        heapsize = heapused/3*4;
+        gcstats.grows++;
+    }
 
-    Value *v = alloc(type);
-    v->func.name = NULL;
-    v->func.params = params;
-    v->func.body = body;
-    v->func.env = env;
-    return v;
+    // enough to scan everything in use by the time the rest is
+    markrate = (double)heapused / (heapsize - heapused);
+    markdebt = 0;
+
+    gcing = 0;
+
+    double t = now() - start;
+    gcstats.gctime += t;
+    gcpause(t, cputime() - cpustart);
 }
 
-Value *
-mkbuiltin(char *name, Imp imp)
+// Marks as much as the allocation since the last step has paid for,
+// and starts the sweep if there's nothing left to mark, or sweeps. Stops
+// after pausetarget seconds either way.
+void
+gcstep(void)
 {
-    Value *v = alloc(BUILTIN);
-    v->builtin.name = name;
-    v->builtin.imp = imp;
-    return v;
+    double start = now(), cpustart = cputime();
+    // the clock isn't read after every bit of work, so some room is left
+    double deadline = start + pausetarget*9/10;
+    gcing = 1;
+
+    if (marking) {
+        markdebt += markcredit*markrate;
+
+        // the clock is read after every 8 spans, or SCANCHUNK bytes
+        size_t n = 0, scanned = 0;
+        while (mainstack.n > 0 && markdebt > 0) {
+            Span sp = mainstack.spans[--mainstack.n];
+
+            if ((char *)sp.end - (char *)sp.start > SCANCHUNK) {
+                gcpush((char *)sp.start + SCANCHUNK, sp.end);
+                sp.end = (char *)sp.start + SCANCHUNK;
+            }
+            gcscan(sp.start, sp.end);
+            markdebt -= (char *)sp.end - (char *)sp.start;
+            scanned += (char *)sp.end - (char *)sp.start;
+
+            if ((++n == 8 || scanned >= SCANCHUNK) && now() >= deadline) {
+                break;
+            }
+            if (n == 8 || scanned >= SCANCHUNK) {
+                n = scanned = 0;
+            }
+        }
+
+        if (mainstack.n == 0) {
+            markdebt = 0;
+            gcfinish(1);
+        }
+    }
+
+    if (sweeping && now() < deadline) {
+        sweepstep(deadline);
+    }
+
+    gcing = 0;
+    markcredit = 0;
+
+    double t = now() - start;
+    gcstats.steps++;
+    gcstats.gctime += t;
+    gcpause(t, cputime() - cpustart);
 }
 
-Value *symtab = NULL;
+// Counts n bytes of allocation towards the next gcstep.
+void
+gccredit(size_t n)
+{
+    if ((marking || sweeping) && !gcing && (markcredit += n) >= STEPBYTES) {
+        gcstep();
+    }
+}
 
-Value *
-intern(char *s)
+// Starts an incremental collection if the heap will be three quarters
+// full once n more bytes are used. If one's already running and the
+// heap will be full, marking has fallen behind, and the heap grows by a
+// quarter rather than the collection being finished in one long pause.
+void
+gcmaybestart(size_t n)
 {
-    Value *l = symtab;
+    if (!incremental || gcing) {
+        return;
+    }
 
-    assert(is_nil(l) || is_pair(l));
+    if (!marking && !sweeping && heapused + n > heapsize/4*3) {
+        gcstart();
+    } else if ((marking || sweeping) && heapused + n > heapsize) {
+        heapsize += heapsize/4;
+        gcstats.grows++;
+    }
+}
 
-    while (!is_nil(l)) {
-        Value *sym = l->pair.car;
-        assert(is_symbol(sym));
+// Counts n more bytes of pages or large objects as used, growing the
+// heap if they don't fit. Callers collect first if they can.
+void
+gcreserve(size_t n)
+{
+    heapused += n;
 
-        if (strcmp(sym->sym, s) == 0) {
-            return sym;
+    if (heapused > heapsize) {
+        if (gcing) {
+            needgc = 1;
         }
+        heapsize = heapused;
+        gcstats.grows++;
+    }
+}
 
-        l = l->pair.cdr;
+// Maps an aligned segment and adds its pages to freepages.
+void
+newsegment(void)
+{
+    // twice the size, so an aligned segment can be cut out of it
+    char *p = mmap(NULL, 2*SEGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
     }
 
-    Value *v = alloc(SYMBOL);
+    char *base = (char *)(((uintptr_t)p + SEGSIZE - 1) & ~(uintptr_t)(SEGSIZE-1));
+    if (base > p) {
+        munmap(p, base - p);
+    }
+    munmap(base + SEGSIZE, p + 2*SEGSIZE - (base + SEGSIZE));
 
-    size_t len = strlen(s);
-    char *s1 = xalloc(len + 1);
-    v->sym = strncpy(s1, s, len);
+    Segment *s = xalloc(sizeof(Segment));
+    s->base = base;
 
-    symtab = cons(v, symtab);
+    for (int i = SEGPAGES-1; i >= 0; i--) {
+        HPage *pg = &s->pages[i];
 
-    return v;
+        pg->base = base + i*HPAGESIZE;
+        pg->class = NOCLASS;
+        pg->next = freepages;
+        freepages = pg;
+    }
+
+    segs = xrealloc(segs, (nsegs+1)*sizeof(Segment *));
+
+    size_t i = nsegs;
+    for (; i > 0 && segs[i-1]->base > base; i--) {
+        segs[i] = segs[i-1];
+    }
+    segs[i] = s;
+    nsegs++;
 }
 
-void
-fprint0(FILE *stream, Value *v, int depth)
+// Gives a free page to class c.
+HPage *
+newpage(size_t c)
 {
-    if (is_nil(v)) {
-        fprintf(stream, "nil");
-    } else if (is_symbol(v)) {
-        fprintf(stream, "%s", v->sym);
-    } else if (is_integer(v)) {
-        fprintf(stream, "%lld", v->n);
-    } else if (is_string(v)) {
-        fprintf(stream, "\"%s\"", v->str->s);
-    } else if (is_builtin(v)) {
-        fprintf(stream, "#<builtin %s>", v->builtin.name);
-    } else if (is_function(v)) {
-        fprintf(stream, "#<function ");
-        if (v->func.name != NULL) {
-            fprintf(stream, "%s", v->func.name->sym);
-        } else {
-            fprintf(stream, "(anonymous)");
+    HPage *pg;
+
+    // still mapped in, so no page faults
+    if (emptypages != NULL) {
+        pg = emptypages;
+        emptypages = pg->next;
+    } else {
+        if (freepages == NULL) {
+            newsegment();
         }
-        fprintf(stream, ">");
-    } else if (is_macro(v)) {
-        fprintf(stream, "#<macro ");
-        if (v->func.name != NULL) {
-            fprintf(stream, "%s", v->func.name->sym);
-        } else {
-            fprintf(stream, "(anonymous)");
+        pg = freepages;
+        freepages = pg->next;
+    }
+    gcreserve(HPAGESIZE);
+
+    pg->class = c;
+    pg->size = classes[c].size;
+    pg->nobjs = HPAGESIZE / pg->size;
+    pg->cursor = 0;
+    pg->next = NULL;
+    memset(pg->alloc, 0, sizeof(pg->alloc));
+    memset(pg->marks, 0, sizeof(pg->marks));
+
+    return pg;
+}
+
+// Returns a free object on pg, or NULL if it's full.
+void *
+pagealloc(HPage *pg)
+{
+    size_t nwords = (pg->nobjs+63)/64;
+
+    for (; pg->cursor < nwords; pg->cursor++) {
+        uint64_t free = ~pg->alloc[pg->cursor];
+
+        // the bits past the last object
+        if (pg->cursor == nwords-1 && pg->nobjs%64 != 0) {
+            free &= (1ull << pg->nobjs%64) - 1;
+        }
+
+        if (free != 0) {
+            int b = __builtin_ctzll(free);
+            pg->alloc[pg->cursor] |= 1ull << b;
+            if (marking) {
+                pg->marks[pg->cursor] |= 1ull << b;
+            }
+            return pg->base + (pg->cursor*64 + b)*pg->size;
         }
-        fprintf(stream, ">");
-    } else if (is_pair(v)){
-        fprintf(stream, "(");
-        fprint0(stream, v->pair.car, depth+1);
+    }
+
+    return NULL;
+}
+
+void *
+smallalloc(size_t size)
+{
+    size_t c = sizeclass[(size+7)/8];
+    SizeClass *sc = &classes[c];
+    int gcd = 0, swept = 0;
+    void *p;
+
+    // Incremental collections grow the heap rather than collect when
+    // it's full, see gcmaybestart.
+    while (sc->cur == NULL || (p = pagealloc(sc->cur)) == NULL) {
+        if (sc->partial != NULL) {
+            sc->cur = sc->partial;
+            sc->partial = sc->cur->next;
+        } else if (sc->unswept != NULL && swept < LAZYSWEEP) {
+            sweepone(c);
+            swept++;
+        } else if (!gcd && !gcing && !incremental && heapused + HPAGESIZE > heapsize) {
+            // this rebuilds the partial lists, so look again
+            gc();
+            gcd = 1;
+        } else {
+            gcmaybestart(HPAGESIZE);
+            sc->cur = newpage(c);
+        }
+    }
+
+    // freed objects keep their old contents
+    memset(p, 0, sc->size);
+
+    return p;
+}
+
+void *
+largealloc(size_t size)
+{
+    size_t mapped = (size + OSPAGE - 1) / OSPAGE * OSPAGE;
+
+    if (!gcing && !incremental && heapused + mapped > heapsize) {
+        gc();
+    } else {
+        gcmaybestart(mapped);
+    }
+    gcreserve(mapped);
+
+    // fresh mappings are zero filled
+    char *p = mmap(NULL, mapped, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    if (nlarges == largescap) {
+        largescap = largescap ? largescap*2 : 64;
+        larges = xrealloc(larges, largescap*sizeof(Large));
+    }
+    larges[nlarges++] = (Large){p, size, mapped, marking, 0};
+
+    return p;
+}
+
+void untag(void *p);
+
+void *
+gcmalloc(size_t size)
+{
+    gcstats.mallocs++;
+    gcstats.mallocbytes += size;
+
+    // before allocating, since finishing rebuilds the partial lists
+    gccredit(size);
+
+    void *p = size > LARGEMAX ? largealloc(size) : smallalloc(size);
+
+    // a reused object may still have a tag
+    if (heapprof) {
+        untag(p);
+    }
+
+    return p;
+}
+
+
+enum Type {
+    SYMBOL,
+    STRING,
+    PAIR,
+    BUILTIN,
+    FUNCTION,
+    MACRO,
+    LOCAL, // a resolved reference to a local variable, only found in code
+    NTYPES,
+};
+typedef enum Type Type;
+
+char *typenames[NTYPES] = {"symbol", "string", "pair", "builtin", "function", "macro", "local"};
+
+struct Buf {
+    char *s;
+    size_t len;
+    size_t cap;
+};
+typedef struct Buf Buf;
+
+// Pairs are just their two fields, with no type. A Value * to a pair
+// has PAIRTAG added to it, which is how is_pair tells it apart from the
+// other types.
+struct Pair {
+    Value *car;
+    Value *cdr;
+};
+typedef struct Pair Pair;
+
+#define PAIRTAG 2
+
+// Function calls get a frame with one slot per parameter. Globals are
+// stored on their symbols instead. Top level code runs with a NULL Env.
+typedef struct Env Env;
+struct Env {
+    Env *parent;
+    int nslots;
+    Value *slots[];
+};
+
+typedef struct Code Code;
+
+struct Func {
+    Value *name;
+    Value *params;
+    Value *body;
+    Env *env;
+    Code *code; // compiled lazily by the VM
+    int nparams; // not counting the rest parameter
+    int rest; // 1 if there's a rest parameter
+};
+typedef struct Func Func;
+
+// A variable found in the slot'th slot of the frame depth levels up
+// from the current one.
+struct Local {
+    Value *name;
+    int depth;
+    int slot;
+};
+typedef struct Local Local;
+
+// Builtins get their already evaluated arguments as a vector, which is
+// on the C stack or the VM stack, never in the heap. Their arity has
+// been checked against min and max by callbuiltin.
+typedef Value *(*Imp)(int argc, Value **argv);
+
+// Special forms, so that eval can dispatch on the head of a form with
+// a switch rather than comparing it against each s_* symbol in turn.
+// car and cdr are only special as lvalues, in evalslot.
+enum Form {
+    FORM_NONE,
+    FORM_QUOTE,
+    FORM_QUASIQUOTE,
+    FORM_IF,
+    FORM_FN,
+    FORM_MACRO,
+    FORM_DEF,
+    FORM_SET,
+    FORM_CAR,
+    FORM_CDR,
+};
+typedef enum Form Form;
+
+struct Symbol {
+    char *name; // NUL terminated, in symarena
+    size_t len;
+    uint64_t hash;
+    Form form;
+    int defined; // as a global
+    Value *value; // the global value cell, set by def and set
+};
+typedef struct Symbol Symbol;
+
+#define VARIADIC -1
+
+struct Builtin {
+    char *name;
+    Imp imp;
+    int min;
+    int max; // or VARIADIC
+};
+typedef struct Builtin Builtin;
+
+// Everything but pairs. Each type is allocated with only as much of
+// the union as it uses, see typesizes.
+struct Value {
+    Type type;
+    union {
+        Symbol sym;
+        Buf *str;
+        Builtin builtin;
+        Func func; // also used for macros
+        Local local;
+    };
+};
+
+size_t typesizes[NTYPES] = {
+    [SYMBOL] = offsetof(Value, sym) + sizeof(Symbol),
+    [STRING] = offsetof(Value, str) + sizeof(Buf *),
+    [PAIR] = sizeof(Pair),
+    [BUILTIN] = offsetof(Value, builtin) + sizeof(Builtin),
+    [FUNCTION] = offsetof(Value, func) + sizeof(Func),
+    [MACRO] = offsetof(Value, func) + sizeof(Func),
+    [LOCAL] = offsetof(Value, local) + sizeof(Local),
+};
+
+Value *
+tagpair(Pair *p)
+{
+    return (Value *)((uintptr_t)p + PAIRTAG);
+}
+
+// v must be a pair.
+Pair *
+topair(Value *v)
+{
+    return (Pair *)((uintptr_t)v - PAIRTAG);
+}
+
+// s_nil can never appear in lisp land. It is read as NULL (empty list);
+Value *s_nil;
+
+Value *s_t;
+Value *t; // s_t
+Value *s_fn;
+Value *s_macro;
+Value *s_quote;
+Value *s_quasiquote;
+Value *s_unquote;
+Value *s_unquote_splicing;
+Value *s_if;
+Value *s_def;
+Value *s_set;
+Value *s_car;
+Value *s_cdr;
+
+Buf *
+binit(char *s)
+{
+    Buf *b = gcmalloc(sizeof(Buf));
+    b->len = strlen(s);
+    b->cap = b->len + 1;
+    b->s = gcmalloc(b->cap);
+    strncpy(b->s, s, b->len);
+    return b;
+}
+
+// The old buffer is left for the collector.
+char *
+gcrealloc(char *p, size_t oldsize, size_t size)
+{
+    char *new = gcmalloc(size);
+    memcpy(new, p, oldsize < size ? oldsize : size);
+    return new;
+}
+
+Buf *
+bappend(Buf *b, char *s)
+{
+    size_t len = strlen(s);
+    if (b->len + len + 1 > b->cap) {
+        size_t cap = b->len + len + 1;
+        b->s = gcrealloc(b->s, b->cap, cap);
+        b->cap = cap;
+    }
+    strncpy(b->s + b->len, s, len);
+    b->len += len;
+    return b;
+}
+
+Buf *
+bputc(Buf *b, char c)
+{
+    // leave room for the terminating NUL
+    if (b->len + 2 > b->cap) {
+        b->s = gcrealloc(b->s, b->cap, b->cap*2);
+        b->cap *= 2;
+    }
+    b->s[b->len++] = c;
+    return b;
+}
+
+// The nursery. Pairs are bump allocated out of fixed size
+// pages. A minor collection copies the survivors into the gcmalloc heap,
+// except for objects that might be referenced from the C stack. Those
+// can't be moved, so their whole page is promoted in place and becomes
+// PAGE_OLD, after which it belongs to the major collector.
+
+#define PAGESIZE (16*1024)
+#define NPAGES 256 // a 4MB nursery
+#define NURSERYMIN 16 // pages; see minorgc
+#define PAGEOBJS (PAGESIZE/sizeof(Pair))
+
+enum PageState {
+    PAGE_FREE,
+    PAGE_YOUNG,
+    PAGE_PINNED, // only during a minor collection
+    PAGE_OLD,
+};
+typedef enum PageState PageState;
+
+typedef struct Page Page;
+struct Page {
+    PageState state;
+    size_t top; // bytes allocated
+    uint64_t marks[(PAGEOBJS+63)/64];
+    uint32_t *sites;
+};
+
+char *nursery;
+Page pages[NPAGES];
+size_t nyoung; // pages allocated from since the last minor collection
+size_t nurserylimit = NPAGES; // on nyoung; see minorgc
+double pagecost;
+Page *curpage;
+char *nurseryp; // bump pointer into curpage
+char *nurserylim;
+
+// Slots outside the nursery that may point into it, recorded by
+// gcwrite. These are roots for a minor collection.
+Value ***remset;
+size_t nremset;
+size_t remsetcap;
+
+// Pairs copied out of the nursery whose fields haven't been updated.
+Pair **promoted;
+size_t npromoted;
+size_t promotedcap;
+
+int nurseryfull;
+
+void
+nurseryinit(void)
+{
+    nursery = xalloc(NPAGES*PAGESIZE);
+}
+
+char *
+pagebase(Page *pg)
+{
+    return nursery + (pg-pages)*PAGESIZE;
+}
+
+Page *
+pageof(void *p)
+{
+    if ((char *)p < nursery || (char *)p >= nursery + NPAGES*PAGESIZE) {
+        return NULL;
+    }
+
+    return &pages[((char *)p - nursery) / PAGESIZE];
+}
+
+// Returns the pair in pg containing p, or NULL if p points past the
+// allocated part of the page.
+Pair *
+objectof(Page *pg, void *p)
+{
+    size_t i = ((char *)p - pagebase(pg)) / sizeof(Pair);
+
+    if (i >= PAGEOBJS || i*sizeof(Pair) >= pg->top) {
+        return NULL;
+    }
+
+    return (Pair *)pagebase(pg) + i;
+}
+
+int is_integer(Value *v);
+
+int
+is_young(void *p)
+{
+    if (is_integer(p)) {
+        return 0;
+    }
+
+    Page *pg = pageof(p);
+    return pg != NULL && pg->state == PAGE_YOUNG;
+}
+
+void
+remember(Value **slot)
+{
+    if (nremset == remsetcap) {
+        remsetcap = remsetcap ? remsetcap*2 : 1024;
+        remset = xrealloc(remset, remsetcap*sizeof(Value **));
+    }
+    remset[nremset++] = slot;
+}
+
+// The write barrier. Every store into an existing object goes through
+// here so that old objects pointing at young ones are found by the
+// next minor collection, and while marking, so that what it overwrites
+// is marked. Stores of arena objects outside the arena are noted for
+// arenaexit.
+void
+gcwrite(Value **slot, Value *v)
+{
+    if (marking && *slot != NULL && !is_integer(*slot)) {
+        gcmark(*slot);
+    }
+    *slot = v;
+
+    if (inarena(v) && !inarena(slot)) {
+        arenaslot(slot, 0);
+    }
+    if (is_young(v) && !is_young(slot)) {
+        remember(slot);
+    }
+}
+
+void
+syncpage(void)
+{
+    if (curpage != NULL) {
+        curpage->top = nurseryp - pagebase(curpage);
+    }
+}
+
+int
+nextpage(void)
+{
+    syncpage();
+
+    if (nyoung >= nurserylimit) {
+        return 0;
+    }
+
+    for (Page *pg = pages; pg < pages+NPAGES; pg++) {
+        if (pg->state == PAGE_FREE) {
+            nyoung++;
+            pg->state = PAGE_YOUNG;
+            pg->top = 0;
+            curpage = pg;
+            nurseryp = pagebase(pg);
+            nurserylim = nurseryp + PAGEOBJS*sizeof(Pair);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// The car of a nursery pair that has been copied. Its cdr is the copy.
+Value forwarded;
+
+void movetag(void *from, void *to);
+
+// Everything in the nursery is a pair.
+void
+evacuate(Value **slot)
+{
+    Value *v = *slot;
+
+    if (!is_young(v)) {
+        return;
+    }
+
+    Pair *old = topair(v);
+
+    if (old->car == &forwarded) {
+        *slot = old->cdr;
+        return;
+    }
+
+    Pair *new = gcmalloc(sizeof(Pair));
+    *new = *old;
+
+    old->car = &forwarded;
+    old->cdr = *slot = tagpair(new);
+    gcstats.promoted++;
+    if (heapprof) {
+        movetag(old, new);
+    }
+
+    if (npromoted == promotedcap) {
+        promotedcap = promotedcap ? promotedcap*2 : 1024;
+        promoted = xrealloc(promoted, promotedcap*sizeof(Pair *));
+    }
+    promoted[npromoted++] = new;
+}
+
+void
+evacuatefields(Pair *p)
+{
+    evacuate(&p->car);
+    evacuate(&p->cdr);
+}
+
+__attribute__((noinline)) void
+pinstack(void)
+{
+    void *sp = &sp;
+    uintptr_t a = ((uintptr_t)sp + sizeof(void *) - 1) & ~(uintptr_t)(sizeof(void *) - 1);
+
+    for (void **w = (void **)a; (void *)(w+1) <= stacktop; w++) {
+        Page *pg = pageof(*w);
+
+        if (pg != NULL && pg->state == PAGE_YOUNG && objectof(pg, *w) != NULL) {
+            pg->state = PAGE_PINNED;
+            gcstats.pinned++;
+        }
+    }
+}
+
+void
+minorgc(void)
+{
+    double start = now(), cpustart = cputime();
+    size_t copied = gcstats.promoted;
+    int wasgcing = gcing;
+    gcing = 1;
+
+    syncpage();
+
+    jmp_buf regs;
+    setjmp(regs);
+    pinstack();
+
+    for (Root *r = roots; r != NULL; r = r->next) {
+        evacuate((Value **)r->p);
+    }
+    vmroots(evacuate);
+
+    for (size_t i = 0; i < nremset; i++) {
+        evacuate(remset[i]);
+    }
+
+    // The pair holding a slot on arenaslots has to be kept until
+    // arenaexit, and the slot moves with it.
+    for (size_t i = 0; i < narenaslots; i++) {
+        Page *pg = pageof((void *)arenaslots[i]);
+
+        if (pg != NULL && pg->state == PAGE_YOUNG) {
+            size_t off = arenaslots[i] % sizeof(Pair);
+            Value *p = tagpair((Pair *)(arenaslots[i] - off));
+            evacuate(&p);
+            arenaslots[i] = (uintptr_t)topair(p) + off;
+        }
+    }
+
+    // Everything on a pinned page is treated as live.
+    for (Page *pg = pages; pg < pages+NPAGES; pg++) {
+        if (pg->state != PAGE_PINNED) {
+            continue;
+        }
+
+        for (Pair *p = (Pair *)pagebase(pg); (char *)p < pagebase(pg) + pg->top; p++) {
+            evacuatefields(p);
+        }
+    }
+
+    while (npromoted > 0) {
+        evacuatefields(promoted[--npromoted]);
+    }
+
+    for (Page *pg = pages; pg < pages+NPAGES; pg++) {
+        if (pg->state == PAGE_YOUNG) {
+            pg->state = PAGE_FREE;
+        } else if (pg->state == PAGE_PINNED) {
+            // while marking, it's as if everything on it was just
+            // allocated
+            pg->state = PAGE_OLD;
+            memset(pg->marks, marking ? 0xff : 0, sizeof(pg->marks));
+        }
+    }
+
+    nremset = 0;
+    nyoung = 0;
+    curpage = NULL;
+    nurseryp = nurserylim = NULL;
+
+    gcing = wasgcing;
+
+    // a minor collection started by gc is counted as part of it
+    double t = now() - start;
+
+    // How long this took depends on how much survived, which is at most
+    // the whole nursery. When collecting incrementally, the nursery is
+    // limited to as many pages as could be copied in half the pause
+    // target if everything on them survived, since the cost of a page
+    // varies by as much again. pagecost is what copying a page has
+    // cost, in CPU time so that being preempted doesn't count; it goes
+    // up straight away but down only gradually.
+    // Each minor collection usually pins the page being allocated from,
+    // until a major one finds it empty, so too small a nursery would
+    // soon be all pinned pages, and it's never less than NURSERYMIN.
+    double cpu = cputime() - cpustart;
+    copied = gcstats.promoted - copied;
+    if (incremental && copied >= PAGEOBJS) {
+        double cost = cpu / ((double)copied/PAGEOBJS);
+        pagecost = cost > pagecost ? cost : (pagecost + cost)/2;
+
+        double limit = pausetarget/2 / pagecost;
+        nurserylimit = limit < NURSERYMIN ? NURSERYMIN : limit > NPAGES ? NPAGES : (size_t)limit;
+    }
+    if (!wasgcing) {
+        gcstats.minorgcs++;
+        gcstats.minortime += t;
+        gcpause(t, cpu);
+    }
+}
+
+// Called by gcmark for every candidate pointer. Returns 1 if p points
+// into the nursery, whether or not it marked anything.
+int
+nurserymark(void *p)
+{
+    Page *pg = pageof(p);
+
+    if (pg == NULL) {
+        return 0;
+    }
+
+    Pair *o;
+    if (pg->state != PAGE_OLD || (o = objectof(pg, p)) == NULL) {
+        return 1;
+    }
+
+    size_t i = o - (Pair *)pagebase(pg);
+    if (setmark(&pg->marks[i/64], 1ull << i%64)) {
+        gcpush(o, o + 1);
+    }
+
+    return 1;
+}
+
+// Pages promoted in place are freed once nothing on them is marked.
+void
+nurserysweep(void)
+{
+    for (Page *pg = pages; pg < pages+NPAGES; pg++) {
+        if (pg->state != PAGE_OLD) {
+            continue;
+        }
+
+        int live = 0;
+        for (size_t i = 0; i < sizeof(pg->marks)/sizeof(pg->marks[0]); i++) {
+            live |= pg->marks[i] != 0;
+        }
+
+        if (!live) {
+            pg->state = PAGE_FREE;
+            nurseryfull = 0;
+        }
+        memset(pg->marks, 0, sizeof(pg->marks));
+    }
+}
+
+// Gets a fresh nursery page, collecting if there isn't one. Returns 0
+// if every page is still pinned afterwards, in which case allocation
+// goes to the main heap until the next major collection frees some.
+int
+refill(void)
+{
+    if (nurseryfull) {
+        return 0;
+    }
+
+    gccredit(PAGESIZE);
+
+    if (nextpage()) {
+        return 1;
+    }
+
+    // When collecting incrementally, running out during promotion
+    // starts a collection rather than doing a whole one.
+    minorgc();
+    if (needgc && !incremental) {
+        gc();
+    }
+    gcmaybestart(0);
+
+    if (nextpage()) {
+        return 1;
+    }
+
+    nurseryfull = 1;
+    return 0;
+}
+
+size_t allocs[NTYPES]; // for gc-stats
+
+void tagsite(void *p);
+
+// Pairs are made by cons, everything else by alloc.
+Value *
+alloc(Type t)
+{
+    assert(t != PAIR);
+
+    // closures made by macros are copied out by arenaexit if they're
+    // still wanted
+    if (expanding && (t == FUNCTION || t == MACRO)) {
+        Value *v = arenaalloc(typesizes[t]);
+        if (v != NULL) {
+            v->type = t;
+            return v;
+        }
+    }
+
+    Value *v = gcmalloc(typesizes[t]);
+
+    v->type = t;
+    allocs[t]++;
+    if (heapprof) {
+        tagsite(v);
+    }
+    return v;
+}
+
+int
+is_nil(Value *v) {
+    return v == NULL;
+}
+
+// Integers are immediate: a fixnum n is stored as the "pointer"
+// 2n+1. Heap objects are at least 8 byte aligned, so the low bit tells
+// them apart.
+
+#define FIXNUM_MAX (INT64_MAX >> 1)
+#define FIXNUM_MIN (INT64_MIN >> 1)
+
+int
+is_integer(Value *v) {
+    return ((uintptr_t)v & 1) != 0;
+}
+
+int
+is_pair(Value *v) {
+    return ((uintptr_t)v & 3) == PAIRTAG;
+}
+
+// Non-nil, not a fixnum and not a pair, i.e. it's safe to look at
+// v->type.
+int
+is_object(Value *v) {
+    return !is_nil(v) && !is_integer(v) && !is_pair(v);
+}
+
+int
+is_symbol(Value *v) {
+    return is_object(v) && v->type == SYMBOL;
+}
+
+int
+is_string(Value *v) {
+    return is_object(v) && v->type == STRING;
+}
+
+int
+is_builtin(Value *v) {
+    return is_object(v) && v->type == BUILTIN;
+}
+
+int
+is_function(Value *v) {
+    return is_object(v) && v->type == FUNCTION;
+}
+
+int
+is_procedure(Value *v) {
+    return is_function(v) || is_builtin(v);
+}
+
+int
+is_macro(Value *v) {
+    return is_object(v) && v->type == MACRO;
+}
+
+int
+is_local(Value *v) {
+    return is_object(v) && v->type == LOCAL;
+}
+
+Value *
+car(Value *v)
+{
+    if (is_pair(v)) {
+        return topair(v)->car;
+    } else {
+        return NULL;
+    }
+}
+
+Value *
+cdr(Value *v)
+{
+    if (is_pair(v)) {
+        return topair(v)->cdr;
+    } else {
+        return NULL;
+    }
+}
+
+Value *
+caar(Value *v)
+{
+    return car(car(v));
+}
+
+Value *
+cadr(Value *v)
+{
+    return car(cdr(v));
+}
+
+Value *
+cddr(Value *v)
+{
+    return cdr(cdr(v));
+}
+
+Value *
+cadar(Value *v)
+{
+    return car(cdr(car(v)));
+}
+
+Value *
+cddar(Value *v)
+{
+    return cdr(cdr(car(v)));
+}
+
+Value *
+caddr(Value *v)
+{
+    return car(cdr(cdr(v)));
+}
+
+Value *
+cdddr(Value *v)
+{
+    return cdr(cdr(cdr(v)));
+}
+
+Value *
+caddar(Value *v)
+{
+    return car(cdr(cdr(car(v))));
+}
+
+Value *
+cons(Value *car, Value *cdr)
+{
+    Pair *p;
+
+    if (expanding && (p = arenaalloc(sizeof(Pair))) != NULL) {
+        p->car = car;
+        p->cdr = cdr;
+
+        // the arena is remembered like the heap
+        if (is_young(car)) {
+            remember(&p->car);
+        }
+        if (is_young(cdr)) {
+            remember(&p->cdr);
+        }
+        return tagpair(p);
+    }
+
+    if (nurseryp < nurserylim || refill()) {
+        p = (Pair *)nurseryp;
+        nurseryp += sizeof(Pair);
+    } else {
+        p = gcmalloc(sizeof(Pair));
+
+        // the nursery is full of pinned pages, so this is old, and young
+        // values in it are remembered like gcwrite would. Later stores
+        // into it go through gcwrite.
+        if (is_young(car)) {
+            remember(&p->car);
+        }
+        if (is_young(cdr)) {
+            remember(&p->cdr);
+        }
+    }
+
+    p->car = car;
+    p->cdr = cdr;
+
+    // the arena is full
+    if (expanding && inarena(car)) {
+        arenaslot(&p->car, 0);
+    }
+    if (expanding && inarena(cdr)) {
+        arenaslot(&p->cdr, 0);
+    }
+
+    allocs[PAIR]++;
+    if (heapprof) {
+        tagsite(p);
+    }
+
+    return tagpair(p);
+}
+
+// What arenaexit copies is made with gcmalloc, since gcing is set, and
+// slots in the copies are filled in with copyfield.
+void
+copyfield(Value **slot, Value *v)
+{
+    *slot = v;
+    if (is_young(v)) {
+        remember(slot);
+    }
+}
+
+// While marking, copies are scanned rather than just being marked as
+// new objects are, since the arena objects they replace might not have
+// been yet.
+void
+copied(void *p, size_t size)
+{
+    if (marking) {
+        gcpush(p, (char *)p + size);
+    }
+}
+
+Value *copyout(Value *v);
+
+Env *
+copyenv(Env *e)
+{
+    if (!inarena(e)) {
+        return e;
+    }
+
+    void **fwd = &arenafwd[((char *)e - arena)/16];
+    if (*fwd != NULL) {
+        return *fwd;
+    }
+
+    size_t size = sizeof(Env) + e->nslots*sizeof(Value *);
+    Env *c = gcmalloc(size);
+    *fwd = c;
+
+    c->nslots = e->nslots;
+    c->parent = copyenv(e->parent);
+    for (int i = 0; i < e->nslots; i++) {
+        copyfield(&c->slots[i], copyout(e->slots[i]));
+    }
+    copied(c, size);
+    return c;
+}
+
+// Returns a copy of v on the heap if it's in the arena. Whatever it
+// refers to in the arena is copied too, once only.
+Value *
+copyout(Value *v)
+{
+    Value *head = NULL;
+    Pair *last = NULL;
+
+    // the cdrs of a list are followed in a loop rather than recursively
+    while (inarena(v)) {
+        void **fwd = &arenafwd[((uintptr_t)v - (uintptr_t)arena)/16];
+        if (*fwd != NULL) {
+            v = *fwd;
+            break;
+        }
+
+        if (!is_pair(v)) {
+            // a closure
+            Value *c = alloc(v->type);
+            *fwd = c;
+
+            c->func = v->func;
+            copyfield(&c->func.params, copyout(v->func.params));
+            copyfield(&c->func.body, copyout(v->func.body));
+            c->func.env = copyenv(v->func.env);
+            // its code would refer into the arena
+            if (inarena(v->func.body)) {
+                c->func.code = NULL;
+            }
+            copied(c, typesizes[c->type]);
+
+            v = c;
+            break;
+        }
+
+        Pair *p = gcmalloc(sizeof(Pair));
+        *fwd = tagpair(p);
+        allocs[PAIR]++;
+
+        copyfield(&p->car, copyout(car(v)));
+        p->cdr = NULL;
+        copied(p, sizeof(Pair));
+
+        if (last == NULL) {
+            head = tagpair(p);
+        } else {
+            last->cdr = tagpair(p);
+        }
+        last = p;
+        v = cdr(v);
+    }
+
+    if (last == NULL) {
+        return v;
+    }
+    copyfield(&last->cdr, v);
+    return head;
+}
+
+// Call before expanding a top level form, and arenaexit with the
+// result after resolving it.
+void
+arenaenter(void)
+{
+    // the heap profiler would be left with tags for arena addresses
+    if (arenadepth++ == 0) {
+        expanding = !heapprof;
+    }
+}
+
+// Returns v copied out of the arena, after repointing every slot on
+// arenaslots at copies too, and resets the arena.
+Value *
+arenaexit(Value *v)
+{
+    if (--arenadepth > 0) {
+        return v;
+    }
+    expanding = 0;
+    if (arenaused == 0) {
+        return v;
+    }
+
+    // no collection can happen with the copies half made
+    int wasgcing = gcing;
+    gcing = 1;
+
+    v = copyout(v);
+    for (size_t i = 0; i < narenaslots; i++) {
+        void **slot = (void **)(arenaslots[i] & ~(uintptr_t)ARENAENV);
+
+        // it might have been overwritten since
+        if (!inarena(*slot)) {
+            continue;
+        }
+        if (arenaslots[i] & ARENAENV) {
+            *slot = copyenv(*slot);
+        } else {
+            *slot = copyout(*slot);
+        }
+        gcstats.arenaescapes++;
+    }
+    narenaslots = 0;
+
+    gcing = wasgcing;
+
+    size_t n = 0;
+    for (size_t i = 0; i < nremset; i++) {
+        if (!inarena(remset[i])) {
+            remset[n++] = remset[i];
+        }
+    }
+    nremset = n;
+
+    // A form that used a lot of the arena gives back what it used
+    // beyond ARENAKEEP, which madvise leaves zeroed.
+    size_t used = arenaused < ARENAKEEP ? arenaused : ARENAKEEP;
+    memset(arenafwd, 0, used/16*sizeof(void *));
+    memset(arenastarts, 0, (used/16 + 63)/64*sizeof(uint64_t));
+    memset(arenamarks, 0, (used/16 + 63)/64*sizeof(uint64_t));
+    if (arenaused > ARENAKEEP) {
+        size_t extra = arenaused - ARENAKEEP;
+        size_t words = (arenaused/16 + 63)/64 - ARENAKEEP/16/64;
+        madvise(arena + ARENAKEEP, extra, MADV_DONTNEED);
+        madvise(arenafwd + ARENAKEEP/16, extra/16*sizeof(void *), MADV_DONTNEED);
+        madvise(arenastarts + ARENAKEEP/16/64, words*sizeof(uint64_t), MADV_DONTNEED);
+        madvise(arenamarks + ARENAKEEP/16/64, words*sizeof(uint64_t), MADV_DONTNEED);
+    }
+    arenaused = 0;
+
+    return v;
+}
+
+void
+overflow(void)
+{
+    fprintf(stderr, "integer overflow\n");
+    exit(1);
+}
+
+Value *
+mkint(long long n)
+{
+    if (n < FIXNUM_MIN || n > FIXNUM_MAX) {
+        overflow();
+    }
+
+    return (Value *)(((uintptr_t)n << 1) | 1);
+}
+
+long long
+intval(Value *v)
+{
+    return (intptr_t)v >> 1;
+}
+
+Value *
+mkstring(Buf *b)
+{
+    Value *v = alloc(STRING);
+    v->str = b;
+    return v;
+}
+
+Value *
+mkfunc(Type type, Value *params, Value *body, Env *env)
+{
+    assert(type == FUNCTION || type == MACRO);
+
+    Value *v = alloc(type);
+    v->func.name = NULL;
+    gcwrite(&v->func.params, params);
+    gcwrite(&v->func.body, body);
+    v->func.env = env;
+    v->func.code = NULL;
+    // the arena is full
+    if (inarena(env) && !inarena(v)) {
+        arenaslot(&v->func.env, ARENAENV);
+    }
+
+    v->func.nparams = 0;
+    for (; is_pair(params); params = cdr(params)) {
+        v->func.nparams++;
+    }
+    v->func.rest = is_symbol(params);
+
+    return v;
+}
+
+Value *
+mklocal(Value *name, int depth, int slot)
+{
+    Value *v = alloc(LOCAL);
+    v->local.name = name;
+    v->local.depth = depth;
+    v->local.slot = slot;
+    return v;
+}
+
+Value *
+mkbuiltin(char *name, Imp imp, int min, int max)
+{
+    Value *v = alloc(BUILTIN);
+    v->builtin.name = name;
+    v->builtin.imp = imp;
+    v->builtin.min = min;
+    v->builtin.max = max;
+    return v;
+}
+
+// Symbol names are packed into large chunks that are never freed.
+#define SYMARENA_CHUNK (64*1024)
+
+char *symarena;
+size_t symarenalen;
+size_t symarenacap;
+
+char *
+savename(char *s, size_t len)
+{
+    if (symarenalen + len + 1 > symarenacap) {
+        symarenacap = len + 1 > SYMARENA_CHUNK ? len + 1 : SYMARENA_CHUNK;
+        symarena = xalloc(symarenacap);
+        symarenalen = 0;
+    }
+
+    char *name = symarena + symarenalen;
+    memcpy(name, s, len);
+    name[len] = '\0';
+    symarenalen += len + 1;
+
+    return name;
+}
+
+// FNV-1a
+uint64_t
+hashname(char *s, size_t len)
+{
+    uint64_t h = 14695981039346656037ull;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ull;
+    }
+
+    return h;
+}
+
+// An open addressing hash table with linear probing. The table itself
+// is allocated with gcmalloc and registered with gcroot, which keeps
+// every symbol alive.
+Value **symtab;
+size_t symtabcap; // always a power of two
+size_t nsyms;
+
+void
+symtabgrow(void)
+{
+    Value **old = symtab;
+    size_t oldcap = symtabcap;
+
+    symtabcap = oldcap ? oldcap*2 : 1024;
+    symtab = gcmalloc(symtabcap*sizeof(Value *));
+
+    for (size_t i = 0; i < oldcap; i++) {
+        Value *sym = old[i];
+        if (sym == NULL) {
+            continue;
+        }
+
+        size_t j = sym->sym.hash & (symtabcap-1);
+        while (symtab[j] != NULL) {
+            j = (j+1) & (symtabcap-1);
+        }
+        symtab[j] = sym;
+    }
+}
+
+Value *
+intern0(char *s, size_t len)
+{
+    if (symtab == NULL) {
+        gcroot(&symtab);
+        symtabgrow();
+    }
+
+    uint64_t hash = hashname(s, len);
+    size_t i = hash & (symtabcap-1);
+
+    for (; symtab[i] != NULL; i = (i+1) & (symtabcap-1)) {
+        Symbol *sym = &symtab[i]->sym;
+
+        if (sym->hash == hash && sym->len == len && memcmp(sym->name, s, len) == 0) {
+            return symtab[i];
+        }
+    }
+
+    Value *v = alloc(SYMBOL);
+    v->sym.name = savename(s, len);
+    v->sym.len = len;
+    v->sym.hash = hash;
+
+    // keep the load factor under 1/2
+    if (2*(nsyms+1) > symtabcap) {
+        symtabgrow();
+        i = hash & (symtabcap-1);
+        while (symtab[i] != NULL) {
+            i = (i+1) & (symtabcap-1);
+        }
+    }
+
+    symtab[i] = v;
+    nsyms++;
+
+    return v;
+}
+
+Value *
+intern(char *s)
+{
+    return intern0(s, strlen(s));
+}
+
+// The printer writes the text of a value into outbuf and hands it to
+// stdio all at once. With --bulk-output, what print writes to stdout
+// accumulates in outbuf too and is written straight to fd 1 a block at
+// a time, or at exit.
+
+#define OUTBLOCK (64*1024)
+
+char *outbuf;
+size_t outlen;
+size_t outcap;
+int bulkout;
+
+// Used as a stack of the rest of each list being printed.
+Value **pstack;
+size_t pstackcap;
+
+void
+oputs(char *s, size_t len)
+{
+    if (outlen + len > outcap) {
+        while (outlen + len > outcap) {
+            outcap = outcap ? outcap*2 : OUTBLOCK;
+        }
+        outbuf = xrealloc(outbuf, outcap);
+    }
+    memcpy(outbuf + outlen, s, len);
+    outlen += len;
+}
+
+void
+oputstr(char *s)
+{
+    oputs(s, strlen(s));
+}
+
+void
+oputint(long long n)
+{
+    char buf[24];
+    char *p = buf + sizeof(buf);
+    unsigned long long u = n < 0 ? -(unsigned long long)n : n;
+
+    do {
+        *--p = '0' + u%10;
+        u /= 10;
+    } while (u > 0);
+
+    if (n < 0) {
+        *--p = '-';
+    }
+
+    oputs(p, buf + sizeof(buf) - p);
+}
+
+void
+oputatom(Value *v)
+{
+    if (is_nil(v)) {
+        oputs("nil", 3);
+    } else if (is_symbol(v)) {
+        oputs(v->sym.name, v->sym.len);
+    } else if (is_integer(v)) {
+        oputint(intval(v));
+    } else if (is_string(v)) {
+        oputs("\"", 1);
+        oputstr(v->str->s);
+        oputs("\"", 1);
+    } else if (is_builtin(v)) {
+        oputstr("#<builtin ");
+        oputstr(v->builtin.name);
+        oputs(">", 1);
+    } else if (is_function(v) || is_macro(v)) {
+        oputstr(is_function(v) ? "#<function " : "#<macro ");
+        if (v->func.name != NULL) {
+            oputs(v->func.name->sym.name, v->func.name->sym.len);
+        } else {
+            oputstr("(anonymous)");
+        }
+        oputs(">", 1);
+    } else if (is_local(v)) {
+        oputs(v->local.name->sym.name, v->local.name->sym.len);
+    } else {
+        fprintf(stderr, "print: unknown type\n");
+        exit(1);
+    }
+}
+
+// Appends v to outbuf. Lists are walked with pstack rather than by
+// recursion, so long or deeply nested ones are fine. Nothing here
+// allocates from the heap, so the values on pstack stay put.
+void
+print0(Value *v)
+{
+    size_t sp = 0;
+
+    while (1) {
+        while (is_pair(v)) {
+            if (sp == pstackcap) {
+                pstackcap = pstackcap ? pstackcap*2 : 256;
+                pstack = xrealloc(pstack, pstackcap*sizeof(Value *));
+            }
+            oputs("(", 1);
+            pstack[sp++] = topair(v)->cdr;
+            v = topair(v)->car;
+        }
+
+        oputatom(v);
+
+        while (sp > 0 && is_nil(pstack[sp-1])) {
+            oputs(")", 1);
+            sp--;
+        }
+
+        if (sp == 0) {
+            return;
+        }
+
+        Value *rest = pstack[sp-1];
+        if (is_pair(rest)) {
+            oputs(" ", 1);
+            pstack[sp-1] = topair(rest)->cdr;
+            v = topair(rest)->car;
+        } else {
+            oputs(" . ", 3);
+            pstack[sp-1] = NULL;
+            v = rest;
+        }
+    }
+}
+
+void
+flushout(void)
+{
+    char *p = outbuf;
+
+    while (p < outbuf + outlen) {
+        ssize_t n = write(1, p, outbuf + outlen - p);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1) {
+            break;
+        }
+        p += n;
+    }
+
+    outlen = 0;
+}
+
+void
+fprint(FILE *stream, Value *v)
+{
+    // anything before start is waiting for flushout
+    size_t start = outlen;
+
+    print0(v);
+    oputs("\n", 1);
+
+    fwrite(outbuf + start, 1, outlen - start, stream);
+    outlen = start;
+}
+
+void
+print(Value *v)
+{
+    if (!bulkout) {
+        fprint(stdout, v);
+        return;
+    }
+
+    print0(v);
+    oputs("\n", 1);
+
+    if (outlen >= OUTBLOCK) {
+        flushout();
+    }
+}
+
+Value *
+builtin_print(int argc, Value **argv)
+{
+    effects++;
+    for (int i = 0; i < argc; i++) {
+        print(argv[i]);
+    }
+
+    return NULL;
+}
+
+// The reader works on a byte range with a cursor. Files passed to load
+// are mapped whole. Other input, like stdin, is read in large blocks
+// into a buffer that grows to hold the form being read, so tokens are
+// always contiguous and can be used in place.
+
+typedef struct Reader Reader;
+struct Reader {
+    char *buf;
+    char *p;
+    char *end;
+    size_t cap; // 0 if buf is mapped
+    int fd; // -1 if buf is mapped
+    int eof;
+};
+
+#define READBLOCK (64*1024)
+
+int readstats; // --read-stats
+size_t readbytes;
+double readtime;
+
+void
+rinit(Reader *r, int fd)
+{
+    r->cap = READBLOCK;
+    r->buf = r->p = r->end = xalloc(r->cap);
+    r->fd = fd;
+    r->eof = 0;
+}
+
+// Maps path into r. Returns 0 if the file can't be opened.
+int
+ropen(Reader *r, char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return 0;
+    }
+
+    char *p = MAP_FAILED;
+    if (st.st_size > 0) {
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    if (p == MAP_FAILED) {
+        // empty, or something mmap doesn't like, e.g. a pipe
+        rinit(r, fd);
+        return 1;
+    }
+
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    close(fd);
+
+    r->buf = r->p = p;
+    r->end = p + st.st_size;
+    r->cap = 0;
+    r->fd = -1;
+    r->eof = 1;
+
+    return 1;
+}
+
+void
+rclose(Reader *r)
+{
+    if (r->cap == 0) {
+        munmap(r->buf, r->end - r->buf);
+    } else {
+        free(r->buf);
+    }
+
+    if (r->fd != -1) {
+        close(r->fd);
+    }
+}
+
+// Reads more input onto the end of buf. The cursor may move. Returns 0
+// at EOF.
+int
+fill(Reader *r)
+{
+    if (r->eof) {
+        return 0;
+    }
+
+    if (r->end == r->buf + r->cap) {
+        size_t p = r->p - r->buf, end = r->end - r->buf;
+
+        r->cap *= 2;
+        r->buf = xrealloc(r->buf, r->cap);
+        r->p = r->buf + p;
+        r->end = r->buf + end;
+    }
+
+    ssize_t n;
+    do {
+        n = read(r->fd, r->end, r->buf + r->cap - r->end);
+    } while (n == -1 && errno == EINTR);
+
+    if (n <= 0) {
+        r->eof = 1;
+        return 0;
+    }
+
+    r->end += n;
+    return 1;
+}
+
+int
+peek(Reader *r)
+{
+    if (r->p == r->end && !fill(r)) {
+        return EOF;
+    }
+    return (unsigned char)*r->p;
+}
+
+int
+next(Reader *r)
+{
+    if (r->p == r->end && !fill(r)) {
+        return EOF;
+    }
+    return (unsigned char)*r->p++;
+}
+
+void
+skipspace(Reader *r)
+{
+    int c;
+
+    while ((c = peek(r)) != EOF) {
+        if (c == ';') {
+            while ((c = next(r)) != EOF && c != '\n') {
+            }
+        } else if (isspace(c)) {
+            r->p++;
+        } else {
+            return;
+        }
+    }
+}
+
+int
+is_symchar(int c)
+{
+    return c != EOF && !isspace(c) && c != '(' && c != ')' && c != '.';
+}
+
+int
+is_symstart(int c)
+{
+    return is_symchar(c) && !isdigit(c);
+}
+
+// Parses the digits in [s, end), with an optional leading -.
+long long
+parseint(char *s, char *end)
+{
+    int neg = *s == '-';
+    unsigned long long max = (unsigned long long)FIXNUM_MAX + neg;
+    unsigned long long n = 0;
+
+    for (char *p = s + neg; p < end; p++) {
+        int d = *p - '0';
+
+        if (n > (max - d)/10) {
+            fprintf(stderr, "integer too big '%.*s'\n", (int)(end - s), s);
+            exit(1);
+        }
+        n = n*10 + d;
+    }
+
+    return neg ? -(long long)n : (long long)n;
+}
+
+// States for readform0. The innermost unfinished form is always in
+// readform0's locals.
+enum {
+    R_NONE, // at top level
+    R_LIST, // reading elements
+    R_DOT, // read a '.', the next value is the cdr
+    R_DOTTED, // read the cdr, expecting ')'
+    R_QUOTE, // the next value gets wrapped in a quoting form
+};
+
+// Reads iteratively, so deep nesting and long lists don't use any C
+// stack. The list being read is built in place from head, a dummy pair
+// in front of it, and tail, its last pair. For R_QUOTE, head is the
+// quoting symbol instead. Outer forms are saved in open, a Lisp list
+// of (state head . tail), so the collector can see them.
+Value *
+readform0(Reader *r)
+{
+    Value *open = NULL;
+    int state = R_NONE;
+    Value *head = NULL, *tail = NULL;
+    Value *v;
+
+#define PUSH() (open = cons(cons(mkint(state), cons(head, tail)), open))
+#define POP() (state = intval(caar(open)), head = cadar(open), tail = cddar(open), open = cdr(open))
+
+    while (1) {
+        skipspace(r);
+
+        int c = next(r);
+
+        if (state == R_DOTTED && c != ')') {
+            if (c == EOF) {
+                fprintf(stderr, "expected ')' but got EOF\n");
+            } else {
+                fprintf(stderr, "expected ')' but got '%c'\n", c);
+            }
+            exit(1);
+        }
+
+        if (c == EOF) {
+            if (state == R_LIST || state == R_DOT) {
+                fprintf(stderr, "expected value or ')' but got EOF\n");
+                exit(1);
+            }
+
+            v = NULL;
+        } else if (c == '(') {
+            PUSH();
+            state = R_LIST;
+            head = tail = cons(NULL, NULL);
+            continue;
+        } else if (c == ')' && (state == R_LIST || state == R_DOTTED)) {
+            v = cdr(head);
+            POP();
+        } else if (c == '.' && state == R_LIST && head != tail) {
+            state = R_DOT;
+            continue;
+        } else if (c == '\'' || c == '`' || c == ',') {
+            PUSH();
+            state = R_QUOTE;
+            tail = NULL;
+
+            if (c == '\'') {
+                head = s_quote;
+            } else if (c == '`') {
+                head = s_quasiquote;
+            } else if (peek(r) == '@') {
+                r->p++;
+                head = s_unquote_splicing;
+            } else {
+                head = s_unquote;
+            }
+            continue;
+        } else if (c == '"') {
+            Buf *b = binit("");
+
+            while (1) {
+                c = next(r);
+                if (c == EOF) {
+                    fprintf(stderr, "unterminated string\n");
+                    exit(1);
+                } else if (c == '"') {
+                    break;
+                } else if (c == '\\') {
+                    c = next(r);
+                    if (c == EOF) {
+                        fprintf(stderr, "unterminated string\n");
+                        exit(1);
+                    } else if (c == 'n') {
+                        c = '\n';
+                    } else if (c == 't') {
+                        c = '\t';
+                    } else if (c == 'r') {
+                        c = '\r';
+                    } else if (c == '\\') {
+                        c = '\\';
+                    } else if (c == '"') {
+                        c = '"';
+                    } else {
+                        fprintf(stderr, "unknown escape sequence '\\%c'\n", c);
+                        exit(1);
+                    }
+                }
+
+                bputc(b, c);
+            }
+
+            v = mkstring(b);
+        } else if ((c == '-' && isdigit(peek(r))) || isdigit(c)) {
+            // offsets, because fill can move buf
+            size_t start = r->p - 1 - r->buf;
+
+            while (isdigit(peek(r))) {
+                r->p++;
+            }
+
+            v = mkint(parseint(r->buf + start, r->p));
+        } else if (is_symstart(c)) {
+            size_t start = r->p - 1 - r->buf;
+
+            while (is_symchar(peek(r))) {
+                r->p++;
+            }
+
+            v = intern0(r->buf + start, r->p - (r->buf + start));
+
+            if (v == s_nil) {
+                v = NULL;
+            }
+        } else {
+            fprintf(stderr, "unexpected character: %c\n", c);
+            exit(1);
+        }
+
+        // v is finished. Wrap it in any quotes, then add it to the list
+        // it's in, if there is one.
+        while (state == R_QUOTE) {
+            v = cons(head, cons(v, NULL));
+            POP();
+        }
+
+        if (state == R_NONE) {
+            return v;
+        } else if (state == R_LIST) {
+            Value *p = cons(v, NULL);
+            gcwrite(&topair(tail)->cdr, p);
+            tail = p;
+        } else {
+            gcwrite(&topair(tail)->cdr, v);
+            state = R_DOTTED;
+        }
+    }
+
+#undef PUSH
+#undef POP
+}
+
+double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+// Of this thread, in seconds.
+double
+cputime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+// Reads one top level form.
+Value *
+readform(Reader *r)
+{
+    // Nothing before the cursor is needed any more. Drop it so buf
+    // only grows to fit the largest form.
+    if (r->cap != 0 && r->p != r->buf) {
+        memmove(r->buf, r->p, r->end - r->p);
+        r->end -= r->p - r->buf;
+        r->p = r->buf;
+    }
+
+    size_t start = r->p - r->buf;
+    double t = readstats ? now() : 0;
+
+    Value *v = readform0(r);
+
+    if (readstats) {
+        readtime += now() - t;
+    }
+    readbytes += r->p - r->buf - start;
+
+    return v;
+}
+
+void
+printreadstats(void)
+{
+    double mb = readbytes/1e6;
+    fprintf(stderr, "read: %.2f MB in %.3fs (%.1f MB/s)\n", mb, readtime, readtime > 0 ? mb/readtime : 0);
+}
+
+int
+is_eq(Value *x, Value *y)
+{
+    return x == y;
+}
+
+// Equal fixnums are the same word, so eqv is eq until there are other
+// kinds of numbers.
+int
+is_eqv(Value *x, Value *y)
+{
+    return is_eq(x, y);
+}
+
+int
+is_equal(Value *x, Value *y)
+{
+    if (is_pair(x) && is_pair(y)) {
+        return is_equal(car(x), car(y)) && is_equal(cdr(x), cdr(y));
+    } else {
+        return is_eqv(x, y);
+    }
+}
+
+Value *
+assoc(Value *v, Value *l)
+{
+    if (!is_pair(l) && !is_nil(l)) {
+        fprintf(stderr, "assoc: expected list\n");
+        exit(1);
+    }
+
+    while (!is_nil(l)) {
+        if (is_equal(caar(l), v)) {
+            return car(l);
+        }
+
+        l = cdr(l);
+    }
+
+    return NULL;
+}
+
+Value *
+append(Value *x, Value *y)
+{
+    if (is_nil(x)) {
+        return y;
+    } else {
+        return cons(car(x), append(cdr(x), y));
+    }
+}
+
+int
+length(Value *l)
+{
+    if (!is_pair(l)) {
+        return 0;
+    }
+
+    int len = 0;
+    for (; l != NULL; l = cdr(l)) {
+        len++;
+    }
+
+    return len;
+}
+
+void
+checkarity(Value *f, int len)
+{
+    Func *fn = &f->func;
+    char *name = fn->name ? fn->name->sym.name : "(anonymous)";
+
+    if (fn->rest && len < fn->nparams) {
+        fprintf(stderr, "%s: expected %d or more arguments, got %d\n", name, fn->nparams, len);
+        exit(1);
+    } else if (!fn->rest && len != fn->nparams) {
+        fprintf(stderr, "%s: expected %d arguments, got %d\n", name, fn->nparams, len);
+        exit(1);
+    }
+}
+
+void
+checkargs(Value *f, Value *args)
+{
+    checkarity(f, length(args));
+}
+
+// The profiler. With --profile, a SIGPROF timer samples profstack, a
+// shadow stack of the functions and builtins that are running, along
+// with the phase the top level is in. At exit, the self and total time
+// of each function and phase go to stderr, and the samples are written
+// to a file as collapsed stacks, the input format of flamegraph.pl.
+//
+// The handler only copies names into a preallocated log. Function
+// names are symbol names, and symbols are never freed, so they're still
+// good when the log is read at exit. Everything else happens then.
+//
+// profstack is also what --heap-profile tags allocations with, so it's
+// kept up to date whenever tracing is set, by either flag.
+
+enum Phase {
+    PHASE_INIT,
+    PHASE_READ,
+    PHASE_EXPAND,
+    PHASE_RESOLVE,
+    PHASE_EVAL,
+    PHASE_PRINT,
+    PHASE_GC, // never set, but used for samples taken while collecting
+    NPHASES,
+};
+typedef enum Phase Phase;
+
+char *phasenames[NPHASES] = {"init", "read", "expand", "resolve", "eval", "print", "gc"};
+
+#define PROFSTACK (64*1024) // deeper frames are counted but not recorded
+#define PROFDEPTH 256 // innermost frames kept per sample
+#define PROFLOG (4*1024*1024) // words of samples, about an hour's worth
+#define PROFINTERVAL 1000 // usecs
+
+int profiling;
+int tracing; // profstack is being kept up to date
+char *profpath;
+volatile sig_atomic_t phase;
+
+Value *volatile profstack[PROFSTACK];
+volatile sig_atomic_t profdepth;
+
+// Each sample is its length n, its phase, and then n names, outermost
+// first.
+char **proflog;
+volatile size_t proflen;
+volatile size_t profdropped;
+
+void
+profpush(Value *f)
+{
+    if (profdepth < PROFSTACK) {
+        profstack[profdepth] = f;
+    }
+    profdepth++;
+}
+
+char *
+profname(Value *f)
+{
+    if (is_builtin(f)) {
+        return f->builtin.name;
+    } else if (f->func.name != NULL) {
+        return f->func.name->sym.name;
+    } else {
+        return "(anonymous)";
+    }
+}
+
+void
+profsample(int sig)
+{
+    int depth = profdepth < PROFSTACK ? profdepth : PROFSTACK;
+    int start = depth > PROFDEPTH ? depth - PROFDEPTH : 0;
+    int n = depth - start;
+
+    if (proflen + n + 2 > PROFLOG) {
+        profdropped++;
+        return;
+    }
+
+    proflog[proflen] = (char *)(uintptr_t)n;
+    proflog[proflen+1] = (char *)(uintptr_t)(gcing ? PHASE_GC : phase);
+    for (int i = 0; i < n; i++) {
+        proflog[proflen+2+i] = profname(profstack[start+i]);
+    }
+    proflen += n + 2;
+}
+
+void
+profstart(void)
+{
+    proflog = xalloc(PROFLOG*sizeof(char *));
+
+    struct sigaction sa = {0};
+    sa.sa_handler = profsample;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+
+    struct itimerval it = {{0, PROFINTERVAL}, {0, PROFINTERVAL}};
+    setitimer(ITIMER_PROF, &it, NULL);
+}
+
+typedef struct ProfEntry ProfEntry;
+struct ProfEntry {
+    char *name;
+    size_t self;
+    size_t total;
+    size_t last; // the last sample counted in total, so recursion counts once
+};
+
+int
+cmpself(const void *a, const void *b)
+{
+    const ProfEntry *x = a, *y = b;
+
+    if (x->self != y->self) {
+        return x->self < y->self ? 1 : -1;
+    }
+    return (x->total < y->total) - (x->total > y->total);
+}
+
+// Orders samples, given by their offsets in proflog, so that identical
+// stacks are next to each other.
+int
+cmpsample(const void *a, const void *b)
+{
+    char **x = proflog + *(size_t *)a, **y = proflog + *(size_t *)b;
+    size_t nx = (uintptr_t)x[0], ny = (uintptr_t)y[0];
+
+    if (x[1] != y[1]) {
+        return (uintptr_t)x[1] < (uintptr_t)y[1] ? -1 : 1;
+    }
+
+    for (size_t i = 0; i < nx && i < ny; i++) {
+        int c = strcmp(x[2+i], y[2+i]);
+        if (c != 0) {
+            return c;
+        }
+    }
+
+    return (nx > ny) - (nx < ny);
+}
+
+void
+profreport(void)
+{
+    struct itimerval it = {{0, 0}, {0, 0}};
+    setitimer(ITIMER_PROF, &it, NULL);
+
+    double ms = PROFINTERVAL/1000.0;
+    size_t len = proflen;
+    size_t nsamples = 0;
+    size_t phases[NPHASES] = {0};
+
+    // names to their entries, an open addressing table
+    size_t cap = 1024, nentries = 0;
+    ProfEntry *entries = xalloc(cap*sizeof(ProfEntry));
+
+    for (size_t off = 0; off < len; off += (uintptr_t)proflog[off] + 2) {
+        size_t n = (uintptr_t)proflog[off];
+        char **names = proflog + off + 2;
+
+        nsamples++;
+        phases[(uintptr_t)proflog[off+1]]++;
+
+        for (size_t i = 0; i < n; i++) {
+            if (2*(nentries+1) > cap) {
+                ProfEntry *old = entries;
+                cap *= 2;
+                entries = xalloc(cap*sizeof(ProfEntry));
+
+                for (size_t j = 0; j < cap/2; j++) {
+                    if (old[j].name == NULL) {
+                        continue;
+                    }
+                    size_t k = hashname((char *)&old[j].name, sizeof(char *)) & (cap-1);
+                    while (entries[k].name != NULL) {
+                        k = (k+1) & (cap-1);
+                    }
+                    entries[k] = old[j];
+                }
+                free(old);
+            }
+
+            size_t k = hashname((char *)&names[i], sizeof(char *)) & (cap-1);
+            while (entries[k].name != NULL && entries[k].name != names[i]) {
+                k = (k+1) & (cap-1);
+            }
+
+            ProfEntry *e = &entries[k];
+            if (e->name == NULL) {
+                e->name = names[i];
+                nentries++;
+            }
+
+            // sample numbers start at 1, so last starts out unused
+            if (e->last != nsamples) {
+                e->total++;
+                e->last = nsamples;
+            }
+            if (i == n-1) {
+                e->self++;
+            }
+        }
+    }
+
+    fprintf(stderr, "profile: %zu samples every %.1fms", nsamples, ms);
+    if (profdropped > 0) {
+        fprintf(stderr, ", %zu dropped", (size_t)profdropped);
+    }
+    fprintf(stderr, "\n\n%-10s %10s %7s\n", "phase", "ms", "%");
+
+    for (int i = 0; i < NPHASES; i++) {
+        if (phases[i] > 0) {
+            fprintf(stderr, "%-10s %10.1f %6.1f%%\n", phasenames[i], phases[i]*ms, 100.0*phases[i]/nsamples);
+        }
+    }
+
+    qsort(entries, cap, sizeof(ProfEntry), cmpself);
+
+    fprintf(stderr, "\n%-30s %10s %7s %10s %7s\n", "function", "self ms", "self", "total ms", "total");
+    for (size_t i = 0; i < nentries && i < 40; i++) {
+        ProfEntry *e = &entries[i];
+        fprintf(stderr, "%-30s %10.1f %6.1f%% %10.1f %6.1f%%\n", e->name,
+            e->self*ms, 100.0*e->self/nsamples, e->total*ms, 100.0*e->total/nsamples);
+    }
+
+    free(entries);
+
+    FILE *f = fopen(profpath, "w");
+    if (f == NULL) {
+        fprintf(stderr, "profile: can't open %s\n", profpath);
+        return;
+    }
+
+    size_t *samples = xalloc((nsamples+1)*sizeof(size_t));
+    size_t i = 0;
+    for (size_t off = 0; off < len; off += (uintptr_t)proflog[off] + 2) {
+        samples[i++] = off;
+    }
+    qsort(samples, nsamples, sizeof(size_t), cmpsample);
+
+    for (size_t i = 0; i < nsamples; ) {
+        size_t j = i+1;
+        while (j < nsamples && cmpsample(&samples[i], &samples[j]) == 0) {
+            j++;
+        }
+
+        char **s = proflog + samples[i];
+        fprintf(f, "%s", phasenames[(uintptr_t)s[1]]);
+        for (size_t k = 0; k < (uintptr_t)s[0]; k++) {
+            fprintf(f, ";%s", s[2+k]);
+        }
+        fprintf(f, " %zu\n", j-i);
+
+        i = j;
+    }
+
+    free(samples);
+
+    if (fclose(f) != 0) {
+        fprintf(stderr, "profile: can't write %s\n", profpath);
+    }
+}
+
+// Builtins with min == max take exactly that many arguments.
+Value *
+callbuiltin(Value *f, int argc, Value **argv)
+{
+    Builtin *b = &f->builtin;
+
+    if (b->max == VARIADIC && argc < b->min) {
+        fprintf(stderr, "%s: expected %d or more arguments, got %d\n", b->name, b->min, argc);
+        exit(1);
+    } else if (b->max != VARIADIC && (argc < b->min || argc > b->max)) {
+        fprintf(stderr, "%s: expected %d arguments, got %d\n", b->name, b->min, argc);
+        exit(1);
+    }
+
+    if (!tracing) {
+        return b->imp(argc, argv);
+    }
+
+    sig_atomic_t depth = profdepth;
+    profpush(f);
+    Value *v = b->imp(argc, argv);
+    profdepth = depth;
+
+    return v;
+}
+
+// One slot per parameter, plus one for a rest parameter.
+Env *
+mkframe(Env *parent, int nslots)
+{
+    Env *env = NULL;
+    if (expanding) {
+        env = arenaalloc(sizeof(Env) + nslots*sizeof(Value *));
+    }
+    if (env == NULL) {
+        env = gcmalloc(sizeof(Env) + nslots*sizeof(Value *));
+        if (heapprof) {
+            tagsite(env);
+        }
+    }
+    env->parent = parent;
+    env->nslots = nslots;
+    // the arena is full
+    if (inarena(parent) && !inarena(env)) {
+        arenaslot(&env->parent, ARENAENV);
+    }
+    return env;
+}
+
+// Returns a new frame binding f's parameters to args, which have
+// already been checked by checkargs.
+Env *
+bind(Value *f, Value *args)
+{
+    Value *params = f->func.params;
+    Env *env = mkframe(f->func.env, f->func.nparams + f->func.rest);
+
+    int i = 0;
+    for (; is_pair(params); params = cdr(params), args = cdr(args)) {
+        gcwrite(&env->slots[i++], car(args));
+    }
+
+    if (is_symbol(params)) {
+        gcwrite(&env->slots[i], args);
+    }
+
+    return env;
+}
+
+Value **
+localslot(Value *v, Env *env)
+{
+    for (int i = 0; i < v->local.depth; i++) {
+        env = env->parent;
+    }
+
+    return &env->slots[v->local.slot];
+}
+
+// Returns the value cell of the global variable name, or NULL if name
+// isn't defined.
+Value **
+globalslot(Value *name)
+{
+    if (!is_symbol(name) || !name->sym.defined) {
+        return NULL;
+    }
+
+    return &name->sym.value;
+}
+
+// Can't differentiate between name being undefined and name being
+// bound to nil.
+Value *
+globalval(Value *name)
+{
+    Value **slot = globalslot(name);
+    return slot ? *slot : NULL;
+}
+
+void
+setname(Value *name, Value *value)
+{
+    if (is_function(value) || is_macro(value)) {
+        value->func.name = name;
+    }
+}
+
+Value *
+def(Value *name, Value *value)
+{
+    effects++;
+    name->sym.defined = 1;
+    gcwrite(&name->sym.value, value);
+    setname(name, value);
+    return value;
+}
+
+Value **evalslot(Value *v, Env *env);
+
+Value *
+set(Value *lval, Value *value, Env *env)
+{
+    sig_atomic_t depth = profdepth;
+    Value **slot = evalslot(lval, env);
+    profdepth = depth;
+
+    if (slot == NULL && is_symbol(lval)) {
+        fprintf(stderr, "set: undefined variable: %s\n", lval->sym.name);
+        exit(1);
+    } else if (slot == NULL) {
+        fprintf(stderr, "set: invalid location: ");
+        fprint(stderr, lval);
+        exit(1);
+    }
+
+    gcwrite(slot, value);
+    if (!is_local(lval) || lval->local.depth > 0) {
+        effects++;
+    }
+
+    if (is_symbol(lval)) {
+        setname(lval, value);
+    } else if (is_local(lval)) {
+        setname(lval->local.name, value);
+    }
+
+    return value;
+}
+
+Value*
+quotelist(Value *l)
+{
+    assert(is_pair(l) || is_nil(l));
+
+    if (is_pair(l)) {
+        return cons(cons(s_quote, cons(car(l), NULL)), quotelist(cdr(l)));
+    } else {
+        return NULL;
+    }
+}
+
+Value *evlis(Value *params, Env *env);
+Value *eval(Value *v, Env *env);
+Value *vmapply(Value *f, Value *args);
+extern int treewalk;
+
+// Evaluates args in env and binds them in a new frame for f, then
+// evaluates all but the last expression of f's body. The last one is
+// returned so the caller can evaluate it in *newenv itself, which keeps
+// calls in tail position from growing the C stack. *pushed says whether
+// the caller already has a frame on profstack for this to replace.
+Value *
+enter(Value *f, Value *args, Env *env, Env **newenv, int *pushed)
+{
+    checkargs(f, args);
+
+    // The frame is filled in directly as the arguments are evaluated,
+    // so it's the only allocation unless there's a rest parameter.
+    Env *frame = mkframe(f->func.env, f->func.nparams + f->func.rest);
+
+    int i = 0;
+    for (; i < f->func.nparams; i++, args = cdr(args)) {
+        gcwrite(&frame->slots[i], eval(car(args), env));
+    }
+
+    if (f->func.rest) {
+        gcwrite(&frame->slots[i], evlis(args, env));
+    }
+    *newenv = frame;
+
+    if (tracing && *pushed) {
+        profstack[profdepth-1] = f;
+    } else if (tracing) {
+        profpush(f);
+        *pushed = 1;
+    }
+
+    Value *e = f->func.body;
+    for (; is_pair(cdr(e)); e = cdr(e)) {
+        eval(car(e), *newenv);
+    }
+
+    return car(e);
+}
+
+Value *
+apply(Value *f, Value *args, Env *env)
+{
+    assert(is_function(f) || is_macro(f));
+
+    sig_atomic_t depth = profdepth;
+    int pushed = 0;
+
+    Env *newenv;
+    Value *last = enter(f, args, env, &newenv, &pushed);
+    Value *v = eval(last, newenv);
+
+    profdepth = depth;
+    return v;
+}
+
+// A fingerprint of a global is a hash of the printed definitions of it
+// and of every global its definition names, and theirs, and so on, so
+// a macro's changes if a function it calls is changed. It's a fixnum,
+// so it can be kept in a fasl.
+
+Value **fpsyms; // the globals being fingerprinted
+size_t fpsymscap;
+
+// Fingerprints already taken, which stay good until the next effect.
+typedef struct FpMemo FpMemo;
+struct FpMemo {
+    Value *sym;
+    Value *fp;
+};
+
+FpMemo *fpmemo;
+size_t nfpmemo;
+size_t fpmemocap;
+size_t fpmemoeffects;
+
+// Adds the globals named in v that aren't in the first *n fpsyms.
+void
+fpwalk(Value *v, size_t *n)
+{
+    for (; is_pair(v); v = cdr(v)) {
+        fpwalk(car(v), n);
+    }
+
+    if (!is_symbol(v) || !v->sym.defined) {
+        return;
+    }
+
+    for (size_t i = 0; i < *n; i++) {
+        if (fpsyms[i] == v) {
+            return;
+        }
+    }
+
+    if (*n == fpsymscap) {
+        fpsymscap = fpsymscap ? fpsymscap*2 : 64;
+        fpsyms = xrealloc(fpsyms, fpsymscap*sizeof(Value *));
+    }
+    fpsyms[(*n)++] = v;
+}
+
+// Returns the fingerprint of the global sym, or NULL if it's undefined
+// or its definition includes a closure. What a closure has captured
+// isn't printed, so it can't be told apart from another with the same
+// code.
+Value *
+fingerprint(Value *sym)
+{
+    if (fpmemoeffects != effects) {
+        nfpmemo = 0;
+        fpmemoeffects = effects;
+    }
+
+    for (size_t i = 0; i < nfpmemo; i++) {
+        if (fpmemo[i].sym == sym) {
+            return fpmemo[i].fp;
+        }
+    }
+
+    // anything before start is waiting for flushout
+    size_t start = outlen;
+    size_t n = 0;
+    Value *fp = NULL;
+
+    fpwalk(sym, &n);
+
+    for (size_t i = 0; i < n; i++) {
+        Value *v = fpsyms[i]->sym.value;
+
+        oputatom(fpsyms[i]);
+        oputs(" ", 1);
+
+        if ((is_function(v) || is_macro(v)) && v->func.env != NULL) {
+            n = 0;
+            break;
+        } else if (is_function(v) || is_macro(v)) {
+            oputatom(v);
+            print0(v->func.params);
+            print0(v->func.body);
+            fpwalk(v->func.body, &n);
+        } else {
+            print0(v);
+        }
+
+        oputs("\n", 1);
+    }
+
+    if (n > 0) {
+        fp = mkint(hashname(outbuf + start, outlen - start) >> 2);
+    }
+    outlen = start;
+
+    if (nfpmemo == fpmemocap) {
+        fpmemocap = fpmemocap ? fpmemocap*2 : 16;
+        fpmemo = xrealloc(fpmemo, fpmemocap*sizeof(FpMemo));
+    }
+    fpmemo[nfpmemo++] = (FpMemo){sym, fp};
+
+    return fp;
+}
+
+// The macros called while expanding a form, and their fingerprints.
+// See expandform.
+typedef struct Dep Dep;
+struct Dep {
+    Value *sym; // symbols are never freed
+    Value *fp;
+};
+
+typedef struct Deps Deps;
+struct Deps {
+    Dep *deps;
+    size_t n;
+    size_t cap;
+    int unknown; // a macro couldn't be fingerprinted
+};
+
+Deps *deps; // where expand records macro calls, if anywhere
+
+void
+adddep(Deps *d, Value *sym)
+{
+    for (size_t i = 0; i < d->n; i++) {
+        if (d->deps[i].sym == sym) {
+            return;
+        }
+    }
+
+    Value *fp = fingerprint(sym);
+    if (fp == NULL) {
+        d->unknown = 1;
+        return;
+    }
+
+    if (d->n == d->cap) {
+        d->cap = d->cap ? d->cap*2 : 8;
+        d->deps = xrealloc(d->deps, d->cap*sizeof(Dep));
+    }
+    d->deps[d->n++] = (Dep){sym, fp};
+}
+
+Value *expand(Value *v, Env *env);
+
+Value *
+expandlist(Value *l, Env *env)
+{
+    if (is_pair(l)) {
+        return cons(expand(car(l), env), expandlist(cdr(l), env));
+    } else {
+        return l;
+    }
+}
+
+Value *
+expand(Value *v, Env *env)
+{
+    if (is_pair(v) && car(v) == s_quote) {
+        // quoted data isn't code, and may be too big to walk recursively
+        return v;
+    } else if (is_pair(v)) {
+        v = expandlist(v, env);
+
+        // if car(v) is not a symbol, globalval will return nil
+        Value *macro = globalval(car(v));
+        if (!is_macro(macro)) {
+            return v;
+        }
+
+        if (deps != NULL) {
+            adddep(deps, car(v));
+        }
+
+        if (treewalk) {
+            return expand(apply(macro, quotelist(cdr(v)), env), env);
+        } else {
+            return expand(vmapply(macro, cdr(v)), env);
+        }
+    } else {
+        return v;
+    }
+}
+
+// Resolution runs after expand() and rewrites every reference to a
+// parameter inside a fn or macro body into a LOCAL holding the frame
+// depth and slot index, so eval doesn't look locals up by name. Symbols
+// that aren't in scope are left alone and looked up in globals. scope is
+// a list of parameter lists, innermost first. Quoted data is never
+// touched, and everything else is copied rather than modified.
+
+Value *resolve(Value *v, Value *scope);
+
+Value *
+resolvesym(Value *sym, Value *scope)
+{
+    for (int depth = 0; is_pair(scope); scope = cdr(scope), depth++) {
+        int slot = 0;
+        Value *p = car(scope);
+
+        for (; is_pair(p); p = cdr(p), slot++) {
+            if (car(p) == sym) {
+                return mklocal(sym, depth, slot);
+            }
+        }
+
+        if (p == sym) {
+            return mklocal(sym, depth, slot);
+        }
+    }
+
+    return sym;
+}
+
+Value *
+resolvelist(Value *l, Value *scope)
+{
+    if (is_pair(l)) {
+        return cons(resolve(car(l), scope), resolvelist(cdr(l), scope));
+    } else {
+        return l;
+    }
+}
+
+// Mirrors evalquasi: only unquoted expressions are resolved.
+Value *
+resolvequasi(Value *v, Value *scope)
+{
+    if (is_pair(v) && car(v) == s_unquote) {
+        return cons(s_unquote, resolvelist(cdr(v), scope));
+    } else if (is_pair(v) && car(v) == s_unquote_splicing) {
+        return v;
+    } else if (is_pair(v) && caar(v) == s_unquote_splicing) {
+        return cons(cons(s_unquote_splicing, resolvelist(cdr(car(v)), scope)), resolvequasi(cdr(v), scope));
+    } else if (is_pair(v)) {
+        return cons(resolvequasi(car(v), scope), resolvequasi(cdr(v), scope));
+    } else {
+        return v;
+    }
+}
+
+// Mirrors evalslot, which recognizes (car x), (cdr x) and the
+// branches of if syntactically, even if car or cdr are shadowed.
+Value *
+resolveslot(Value *v, Value *scope)
+{
+    if (is_pair(v) && (car(v) == s_car || car(v) == s_cdr)) {
+        return cons(car(v), resolvelist(cdr(v), scope));
+    } else if (is_pair(v) && car(v) == s_if) {
+        Value *res = cons(s_if, NULL);
+        Value *tail = res;
+
+        for (Value *l = cdr(v); is_pair(l); l = cddr(l)) {
+            Value *cell;
+
+            // tail may be old or in the arena by now, and cell young
+            if (is_pair(cdr(l))) {
+                cell = cons(resolve(car(l), scope), NULL);
+                gcwrite(&topair(tail)->cdr, cell);
+                tail = cell;
+                cell = cons(resolveslot(cadr(l), scope), NULL);
+            } else {
+                cell = cons(resolveslot(car(l), scope), NULL);
+            }
+            gcwrite(&topair(tail)->cdr, cell);
+            tail = cell;
+        }
+
+        return res;
+    } else {
+        return resolve(v, scope);
+    }
+}
+
+Value *
+resolve(Value *v, Value *scope)
+{
+    if (is_symbol(v)) {
+        return resolvesym(v, scope);
+    } else if (!is_pair(v)) {
+        return v;
+    }
+
+    Value *op = car(v);
+
+    if (op == s_quote) {
+        return v;
+    } else if (op == s_quasiquote) {
+        return cons(s_quasiquote, cons(resolvequasi(cadr(v), scope), cddr(v)));
+    } else if (op == s_fn || op == s_macro) {
+        Value *params = cadr(v);
+        return cons(op, cons(params, resolvelist(cddr(v), cons(params, scope))));
+    } else if (op == s_def && length(v) > 3) {
+        // short form lambda definition, e.g. (def inc (x) (+ 1 x))
+        return resolve(cons(s_def, cons(cadr(v), cons(cons(s_fn, cons(caddr(v), cdddr(v))), NULL))), scope);
+    } else if (op == s_def) {
+        // the name is always global
+        return cons(s_def, cons(cadr(v), resolvelist(cddr(v), scope)));
+    } else if (op == s_set) {
+        return cons(s_set, cons(resolveslot(cadr(v), scope), resolvelist(cddr(v), scope)));
+    } else if (op == s_if) {
+        return cons(s_if, resolvelist(cdr(v), scope));
+    } else {
+        return resolvelist(v, scope);
+    }
+}
+
+// Returns the branch of an if that's taken, without evaluating it, so
+// that eval and evalslot can treat it as a tail position.
+Value *
+evif(Value *conditions, Env *env)
+{
+    while (1) {
+        if (is_nil(conditions)) {
+            return NULL;
+        } else if (is_nil(cdr(conditions))) {
+            return car(conditions);
+        } else if (eval(car(conditions), env)) {
+            return cadr(conditions);
+        }
+
+        conditions = cddr(conditions);
+    }
+}
+
+Value *
+evlis(Value *params, Env *env)
+{
+    assert(is_pair(params) || is_nil(params));
+
+    if (is_nil(params)) {
+        return NULL;
+    } else {
+        return cons(eval(car(params), env), evlis(cdr(params), env));
+    }
+}
+
+// The special form v starts with, if any. v must be a pair.
+Form
+formof(Value *v)
+{
+    Value *op = car(v);
+    return is_symbol(op) ? op->sym.form : FORM_NONE;
+}
+
+Value **
+evalslot(Value *v, Env *env)
+{
+    int pushed = 0; // see eval0
+
+    while (1) {
+        if (is_pair(v)) {
+            Value *p;
+
+            switch (formof(v)) {
+            case FORM_CAR:
+                p = eval(cadr(v), env);
+                return is_pair(p) ? &topair(p)->car : NULL;
+            case FORM_CDR:
+                p = eval(cadr(v), env);
+                return is_pair(p) ? &topair(p)->cdr : NULL;
+            case FORM_IF:
+                v = evif(cdr(v), env);
+                continue;
+            case FORM_DEF:
+            case FORM_SET:
+                eval(v, env);
+                v = cadr(v);
+                continue;
+            default:
+                break;
+            }
+
+            Value *f = eval(car(v), env);
+
+            if (is_function(f)) {
+                v = enter(f, cdr(v), env, &env, &pushed);
+            } else {
+                return NULL;
+            }
+        } else if (is_local(v)) {
+            return localslot(v, env);
+        } else if (is_symbol(v)) {
+            return globalslot(v);
+        } else {
+            return NULL;
+        }
+    }
+}
+
+Value *
+evalquasi(Value *v, Env *env)
+{
+    if (is_pair(v) && car(v) == s_unquote) {
+        return eval(cadr(v), env);
+    } else if (is_pair(v) && car(v) == s_unquote_splicing) {
+        fprintf(stderr, "evalquasi: unquote-splicing not in list: ");
+        fprint(stderr, v);
+        exit(1);
+    } else if (is_pair(v) && caar(v) == s_unquote_splicing) {
+        Value *p = eval(cadar(v), env);
+
+        if (!is_pair(p) && !is_nil(p)) {
+            fprintf(stderr, "evalquasi: expected list, got: ");
+            fprint(stderr, p);
+            exit(1);
+        }
+
+        return append(p, evalquasi(cdr(v), env));
+    } else if (is_pair(v)) {
+        return cons(evalquasi(car(v), env), evalquasi(cdr(v), env));
+    } else {
+        return v;
+    }
+}
+
+Value *
+eval0(Value *v, Env *env)
+{
+    int pushed = 0; // whether there's a frame on profstack for this call, see enter
+
+    while (1) {
+        if (is_pair(v)) {
+            Value *name, *val;
+
+            switch (formof(v)) {
+            case FORM_QUOTE:
+                return cadr(v);
+            case FORM_QUASIQUOTE:
+                return evalquasi(cadr(v), env);
+            case FORM_IF:
+                v = evif(cdr(v), env);
+                continue;
+            case FORM_FN:
+                return mkfunc(FUNCTION, cadr(v), cddr(v), env);
+            case FORM_MACRO:
+                return mkfunc(MACRO, cadr(v), cddr(v), env);
+            case FORM_DEF:
+                if (is_pair(cdddr(v))) {
+                    // short form lambda definition, e.g. (def inc (x) (+ 1 x))
+                    v = cons(s_def, cons(cadr(v), cons(cons(s_fn, cons(caddr(v), cdddr(v))), NULL)));
+                    continue;
+                }
+
+                name = cadr(v);
+                val = eval(caddr(v), env);
+
+                if (!is_symbol(name)) {
+                    fprintf(stderr, "def: expected symbol\n");
+                    exit(1);
+                }
+
+                if (globalslot(name)) {
+                    fprintf(stderr, "def: symbol already defined: ");
+                    fprint(stderr, name);
+                    exit(1);
+                }
+
+                return def(name, val);
+            case FORM_SET:
+                val = eval(caddr(v), env);
+                return set(cadr(v), val, env);
+            default:
+                break;
+            }
+
+            Value *f = eval(car(v), env);
+
+            if (is_function(f)) {
+                v = enter(f, cdr(v), env, &env, &pushed);
+            } else if (is_builtin(f)) {
+                int argc = length(cdr(v));
+                Value *argv[argc+1]; // +1 so that it's never empty
+
+                int i = 0;
+                for (Value *a = cdr(v); is_pair(a); a = cdr(a)) {
+                    argv[i++] = eval(car(a), env);
+                }
+
+                return callbuiltin(f, argc, argv);
+            } else if (is_macro(f)) {
+                fprintf(stderr, "can't call a macro at runtime: ");
+                fprint(stderr, car(v));
+                exit(1);
+            } else {
+                fprintf(stderr, "not a function: ");
+                fprint(stderr, car(v));
+                exit(1);
+            }
+        } else if (is_local(v)) {
+            return *localslot(v, env);
+        } else if (is_symbol(v)) {
+            Value **slot = globalslot(v);
+
+            if (slot) {
+                return *slot;
+            } else {
+                fprintf(stderr, "unbound variable: %s\n", v->sym.name);
+                exit(1);
+            }
+        } else {
+            return v;
+        }
+    }
+}
+
+// Pops whatever eval0 pushed on profstack, however it returns.
+Value *
+eval(Value *v, Env *env)
+{
+    if (!tracing) {
+        return eval0(v, env);
+    }
+
+    sig_atomic_t depth = profdepth;
+    v = eval0(v, env);
+    profdepth = depth;
+
+    return v;
+}
+
+// The bytecode compiler and VM. Expanded and resolved forms are compiled
+// once into a Code block for a stack machine, and function bodies are
+// compiled along with the form that contains them. Functions made by
+// the tree-walker, e.g. inside an evalslot, are compiled the first time
+// the VM calls them. Lisp to Lisp calls don't recurse on the C stack.
+//
+// Frames are the same Envs eval uses, so the two can call each other,
+// and eval is still available with --tree-walk for differential testing.
+
+enum Op {
+    OP_CONST,     // k: push consts[k]
+    OP_NIL,
+    OP_LOCAL,     // depth slot
+    OP_GLOBAL,    // k: the value of the symbol consts[k]
+    OP_SETLOCAL,  // k: consts[k] is a LOCAL. Leaves the value on the stack.
+    OP_SETGLOBAL, // k: consts[k] is a symbol
+    OP_SET,       // k: any other lvalue, handled by set()
+    OP_DEF,       // k: consts[k] is the name
+    OP_POP,
+    OP_JUMP,      // target
+    OP_JUMPIFNOT, // target
+    OP_CLOSURE,   // k: consts[k] is a function or macro with no env
+    OP_CONS,
+    OP_APPEND,
+    OP_SPLICEERR, // k: unquote-splicing outside of a list
+    OP_CALL,      // nargs k c: consts[k] is the called expression, for
+                  // errors, and consts[c] is an inline cache of the callee
+    OP_TAILCALL,  // nargs k c: like OP_CALL, but reuses the caller's frame
+    OP_RET,
+};
+typedef enum Op Op;
+
+struct Code {
+    int maxstack;
+    int ninsts;
+    int nconsts;
+    int *insts; // follows consts in the same block
+    Value *consts[];
+};
+
+typedef struct Compiler Compiler;
+struct Compiler {
+    int *insts;
+    int ninsts;
+    int instscap;
+    Value *consts; // a list, most recent first, so the collector sees it
+    int nconsts;
+    int depth;
+    int maxdepth;
+};
+
+int treewalk; // --tree-walk
+
+void
+emit(Compiler *c, int x)
+{
+    if (c->ninsts == c->instscap) {
+        c->instscap = c->instscap ? c->instscap*2 : 64;
+        c->insts = xrealloc(c->insts, c->instscap*sizeof(int));
+    }
+    c->insts[c->ninsts++] = x;
+}
+
+int
+addconst(Compiler *c, Value *v)
+{
+    c->consts = cons(v, c->consts);
+    return c->nconsts++;
+}
+
+void
+stackadj(Compiler *c, int n)
+{
+    c->depth += n;
+    if (c->depth > c->maxdepth) {
+        c->maxdepth = c->depth;
+    }
+}
+
+void
+emitk(Compiler *c, Op op, Value *v, int n)
+{
+    emit(c, op);
+    emit(c, addconst(c, v));
+    stackadj(c, n);
+}
+
+Code *
+finish(Compiler *c)
+{
+    size_t size = sizeof(Code) + c->nconsts*sizeof(Value *) + c->ninsts*sizeof(int);
+    Code *code = gcmalloc(size);
+
+    code->maxstack = c->maxdepth;
+    code->ninsts = c->ninsts;
+    code->nconsts = c->nconsts;
+    code->insts = (int *)&code->consts[c->nconsts];
+    memcpy(code->insts, c->insts, c->ninsts*sizeof(int));
+
+    int i = c->nconsts;
+    for (Value *l = c->consts; l != NULL; l = cdr(l)) {
+        gcwrite(&code->consts[--i], car(l));
+    }
+
+    free(c->insts);
+
+    return code;
+}
+
+void compile(Compiler *c, Value *v, int tail);
+Code *compilebody(Value *body);
+
+void
+compileif(Compiler *c, Value *conditions, int tail)
+{
+    if (is_nil(conditions)) {
+        emit(c, OP_NIL);
+        stackadj(c, 1);
+    } else if (is_nil(cdr(conditions))) {
+        compile(c, car(conditions), tail);
+    } else {
+        compile(c, car(conditions), 0);
+        emit(c, OP_JUMPIFNOT);
+        int alt = c->ninsts;
+        emit(c, 0);
+        stackadj(c, -1);
+
+        compile(c, cadr(conditions), tail);
+        emit(c, OP_JUMP);
+        int end = c->ninsts;
+        emit(c, 0);
+        stackadj(c, -1);
+
+        c->insts[alt] = c->ninsts;
+        compileif(c, cddr(conditions), tail);
+        c->insts[end] = c->ninsts;
+    }
+}
+
+// Mirrors evalquasi.
+void
+compilequasi(Compiler *c, Value *v)
+{
+    if (is_pair(v) && car(v) == s_unquote) {
+        compile(c, cadr(v), 0);
+    } else if (is_pair(v) && car(v) == s_unquote_splicing) {
+        emitk(c, OP_SPLICEERR, v, 1);
+    } else if (is_pair(v) && caar(v) == s_unquote_splicing) {
+        compile(c, cadar(v), 0);
+        compilequasi(c, cdr(v));
+        emit(c, OP_APPEND);
+        stackadj(c, -1);
+    } else if (is_pair(v)) {
+        compilequasi(c, car(v));
+        compilequasi(c, cdr(v));
+        emit(c, OP_CONS);
+        stackadj(c, -1);
+    } else if (is_nil(v)) {
+        emit(c, OP_NIL);
+        stackadj(c, 1);
+    } else {
+        emitk(c, OP_CONST, v, 1);
+    }
+}
+
+// Tail is true when v's value is what the enclosing body returns. Calls
+// in tail position don't grow the VM's frames.
+void
+compile(Compiler *c, Value *v, int tail)
+{
+    if (is_nil(v)) {
+        emit(c, OP_NIL);
+        stackadj(c, 1);
+        return;
+    } else if (is_symbol(v)) {
+        emitk(c, OP_GLOBAL, v, 1);
+        return;
+    } else if (is_local(v)) {
+        emit(c, OP_LOCAL);
+        emit(c, v->local.depth);
+        emit(c, v->local.slot);
+        stackadj(c, 1);
+        return;
+    } else if (!is_pair(v)) {
+        emitk(c, OP_CONST, v, 1);
+        return;
+    }
+
+    Value *op = car(v);
+
+    if (op == s_quote) {
+        if (is_nil(cadr(v))) {
+            emit(c, OP_NIL);
+            stackadj(c, 1);
+        } else {
+            emitk(c, OP_CONST, cadr(v), 1);
+        }
+    } else if (op == s_quasiquote) {
+        compilequasi(c, cadr(v));
+    } else if (op == s_if) {
+        compileif(c, cdr(v), tail);
+    } else if (op == s_fn || op == s_macro) {
+        Value *proto = mkfunc(op == s_fn ? FUNCTION : MACRO, cadr(v), cddr(v), NULL);
+        proto->func.code = compilebody(cddr(v));
+        emitk(c, OP_CLOSURE, proto, 1);
+    } else if (op == s_def) {
+        // resolve has already turned short form definitions into fns
+        compile(c, caddr(v), 0);
+        emitk(c, OP_DEF, cadr(v), 0);
+    } else if (op == s_set) {
+        Value *lval = cadr(v);
+        compile(c, caddr(v), 0);
+
+        if (is_symbol(lval)) {
+            emitk(c, OP_SETGLOBAL, lval, 0);
+        } else if (is_local(lval)) {
+            emitk(c, OP_SETLOCAL, lval, 0);
+        } else {
+            emitk(c, OP_SET, lval, 0);
+        }
+    } else {
+        int nargs = 0;
+        for (Value *l = v; is_pair(l); l = cdr(l)) {
+            compile(c, car(l), 0);
+            nargs++;
+        }
+        nargs--;
+
+        emit(c, tail ? OP_TAILCALL : OP_CALL);
+        emit(c, nargs);
+        emit(c, addconst(c, op));
+        emit(c, addconst(c, NULL));
+        stackadj(c, -nargs);
+    }
+}
+
+Code *
+compilebody(Value *body)
+{
+    Compiler c = {0};
+
+    if (is_nil(body)) {
+        emit(&c, OP_NIL);
+        stackadj(&c, 1);
+    }
+
+    for (Value *e = body; is_pair(e); e = cdr(e)) {
+        compile(&c, car(e), !is_pair(cdr(e)));
+
+        if (is_pair(cdr(e))) {
+            emit(&c, OP_POP);
+            stackadj(&c, -1);
+        }
+    }
+    emit(&c, OP_RET);
+
+    return finish(&c);
+}
+
+Code *
+compiletop(Value *v)
+{
+    return compilebody(cons(v, NULL));
+}
+
+// The VM's value stack and call frames are outside the heap, so the
+// collector visits them through vmroots.
+
+typedef struct Frame Frame;
+struct Frame {
+    Code *code;
+    int *pc;
+    Env *env;
+    size_t bp; // index in vmstack of the called function
+    sig_atomic_t pdepth; // profdepth before the frame's function was pushed
+};
+
+Value **vmstack;
+Value **vmsp;
+Value **vmlim;
+
+Frame *frames;
+size_t nframes;
+size_t framescap;
+
+void
+vmroots(void (*f)(Value **))
+{
+    for (Value **p = vmstack; p < vmsp; p++) {
+        f(p);
+    }
+
+    for (size_t i = 0; i < nframes; i++) {
+        f((Value **)&frames[i].code);
+        f((Value **)&frames[i].env);
+    }
+}
+
+// Makes room for n more values, returning sp adjusted for any move.
+Value **
+vmreserve(Value **sp, size_t n)
+{
+    if (sp + n <= vmlim) {
+        return sp;
+    }
+
+    size_t used = sp - vmstack;
+    size_t cap = vmlim - vmstack;
+
+    while (used + n > cap) {
+        cap = cap ? cap*2 : 4096;
+    }
+
+    vmstack = xrealloc(vmstack, cap*sizeof(Value *));
+    vmlim = vmstack + cap;
+
+    return vmsp = vmstack + used;
+}
+
+void
+pushframe(Code *code, Env *env, size_t bp)
+{
+    if (nframes == framescap) {
+        framescap = framescap ? framescap*2 : 256;
+        frames = xrealloc(frames, framescap*sizeof(Frame));
+    }
+
+    frames[nframes].code = code;
+    frames[nframes].pc = code->insts;
+    frames[nframes].env = env;
+    frames[nframes].bp = bp;
+    frames[nframes].pdepth = profdepth;
+    nframes++;
+}
+
+Code *
+funccode(Value *f)
+{
+    if (f->func.code == NULL) {
+        // code is kept for good, even when compiled during expansion
+        int wasexpanding = expanding;
+        expanding = 0;
+        f->func.code = compilebody(f->func.body);
+        expanding = wasexpanding;
+    }
+    return f->func.code;
+}
+
+// A frame for f with its arguments taken from argv, which points into
+// the VM stack.
+Env *
+bindv(Value *f, int argc, Value **argv)
+{
+    Value *params = f->func.params;
+    Env *env = mkframe(f->func.env, f->func.nparams + f->func.rest);
+
+    int i = 0;
+    for (; is_pair(params); params = cdr(params), i++) {
+        gcwrite(&env->slots[i], argv[i]);
+    }
+
+    if (is_symbol(params)) {
+        Value *rest = NULL;
+        for (int j = argc-1; j >= i; j--) {
+            rest = cons(argv[j], rest);
+        }
+        gcwrite(&env->slots[i], rest);
+    }
+
+    return env;
+}
+
+// Runs code in env until it returns. May be called recursively, e.g.
+// by load or macro expansion.
+Value *
+vmrun(Code *code, Env *env)
+{
+    static void *labels[] = {
+        [OP_CONST] = &&op_const,
+        [OP_NIL] = &&op_nil,
+        [OP_LOCAL] = &&op_local,
+        [OP_GLOBAL] = &&op_global,
+        [OP_SETLOCAL] = &&op_setlocal,
+        [OP_SETGLOBAL] = &&op_setglobal,
+        [OP_SET] = &&op_set,
+        [OP_DEF] = &&op_def,
+        [OP_POP] = &&op_pop,
+        [OP_JUMP] = &&op_jump,
+        [OP_JUMPIFNOT] = &&op_jumpifnot,
+        [OP_CLOSURE] = &&op_closure,
+        [OP_CONS] = &&op_cons,
+        [OP_APPEND] = &&op_append,
+        [OP_SPLICEERR] = &&op_spliceerr,
+        [OP_CALL] = &&op_call,
+        [OP_TAILCALL] = &&op_tailcall,
+        [OP_RET] = &&op_ret,
+    };
+
+    // vmsp is only brought up to date before anything that might
+    // allocate, since a collection needs to see the whole stack.
+    Value **sp = vmreserve(vmsp, code->maxstack);
+    size_t base = nframes;
+    pushframe(code, env, sp - vmstack);
+
+    int *pc = code->insts;
+    Value **consts = code->consts;
+    Value *v, *f;
+    Env *e;
+
+#define NEXT goto *labels[*pc++]
+#define SYNC() (vmsp = sp)
+
+    NEXT;
+
+op_const:
+    *sp++ = consts[*pc++];
+    NEXT;
+
+op_nil:
+    *sp++ = NULL;
+    NEXT;
+
+op_local:
+    e = env;
+    for (int d = pc[0]; d > 0; d--) {
+        e = e->parent;
+    }
+    *sp++ = e->slots[pc[1]];
+    pc += 2;
+    NEXT;
+
+op_global:
+    v = consts[*pc++];
+    if (!v->sym.defined) {
+        fprintf(stderr, "unbound variable: %s\n", v->sym.name);
+        exit(1);
+    }
+    *sp++ = v->sym.value;
+    NEXT;
+
+op_setlocal:
+    v = consts[*pc++];
+    SYNC();
+    gcwrite(localslot(v, env), sp[-1]);
+    setname(v->local.name, sp[-1]);
+    if (v->local.depth > 0) {
+        effects++;
+    }
+    NEXT;
+
+op_setglobal:
+    v = consts[*pc++];
+    if (!v->sym.defined) {
+        fprintf(stderr, "set: undefined variable: %s\n", v->sym.name);
+        exit(1);
+    }
+    SYNC();
+    gcwrite(&v->sym.value, sp[-1]);
+    setname(v, sp[-1]);
+    effects++;
+    NEXT;
+
+op_set:
+    SYNC();
+    frames[nframes-1].pc = pc;
+    set(consts[*pc++], sp[-1], env);
+    NEXT;
+
+op_def:
+    v = consts[*pc++];
+    if (!is_symbol(v)) {
+        fprintf(stderr, "def: expected symbol\n");
+        exit(1);
+    }
+    if (v->sym.defined) {
+        fprintf(stderr, "def: symbol already defined: ");
+        fprint(stderr, v);
+        exit(1);
+    }
+    SYNC();
+    def(v, sp[-1]);
+    NEXT;
+
+op_pop:
+    sp--;
+    NEXT;
+
+op_jump:
+    pc = code->insts + *pc;
+    NEXT;
+
+op_jumpifnot:
+    if (*--sp == NULL) {
+        pc = code->insts + *pc;
+    } else {
+        pc++;
+    }
+    NEXT;
+
+op_closure:
+    f = consts[*pc++];
+    SYNC();
+    v = mkfunc(f->type, f->func.params, f->func.body, env);
+    v->func.code = f->func.code;
+    *sp++ = v;
+    NEXT;
+
+op_cons:
+    SYNC();
+    v = cons(sp[-2], sp[-1]);
+    *--sp = NULL;
+    sp[-1] = v;
+    NEXT;
+
+op_append:
+    if (!is_pair(sp[-2]) && !is_nil(sp[-2])) {
+        fprintf(stderr, "evalquasi: expected list, got: ");
+        fprint(stderr, sp[-2]);
+        exit(1);
+    }
+    SYNC();
+    v = append(sp[-2], sp[-1]);
+    *--sp = NULL;
+    sp[-1] = v;
+    NEXT;
+
+op_spliceerr:
+    fprintf(stderr, "evalquasi: unquote-splicing not in list: ");
+    fprint(stderr, consts[*pc]);
+    exit(1);
+
+op_call: {
+    int nargs = pc[0];
+    Value **argv = sp - nargs;
+    f = argv[-1];
+
+    SYNC();
+    frames[nframes-1].pc = pc + 3;
+
+    // The cache holds the last function called from here, which is
+    // known to be compiled and to take nargs arguments. Closures in the
+    // expansion arena aren't cached, since the arena is reused.
+    if (f != consts[pc[2]] && is_function(f)) {
+        checkarity(f, nargs);
+        funccode(f);
+        if (!inarena(f)) {
+            gcwrite(&consts[pc[2]], f);
+        }
+    }
+
+    if (f != NULL && (f == consts[pc[2]] || (inarena(f) && is_function(f)))) {
+        e = bindv(f, nargs, argv);
+        code = f->func.code;
+
+        // the collector doesn't look past vmsp, so drop the arguments
+        // only after they've been bound
+        sp = vmsp = argv - 1;
+        sp = vmreserve(sp, code->maxstack);
+
+        pushframe(code, e, sp - vmstack);
+        if (tracing) {
+            profpush(f);
+        }
+
+        env = e;
+        pc = code->insts;
+        consts = code->consts;
+    } else if (is_builtin(f)) {
+        // a builtin like load can run the VM recursively, which might
+        // move the stack
+        size_t bp = argv - 1 - vmstack;
+
+        v = callbuiltin(f, nargs, argv);
+        sp = vmstack + bp;
+        *sp++ = v;
+        pc += 3;
+    } else if (is_macro(f)) {
+        fprintf(stderr, "can't call a macro at runtime: ");
+        fprint(stderr, consts[pc[1]]);
+        exit(1);
+    } else {
+        fprintf(stderr, "not a function: ");
+        fprint(stderr, consts[pc[1]]);
+        exit(1);
+    }
+    NEXT;
+}
+
+// Builtins don't use a frame, so a tail call to one is an ordinary
+// call followed by the RET or JUMP to one that compile emitted after it.
+op_tailcall: {
+    int nargs = pc[0];
+    Value **argv = sp - nargs;
+    f = argv[-1];
+
+    if (!is_function(f)) {
+        goto op_call;
+    }
+
+    SYNC();
+    if (f != consts[pc[2]]) {
+        checkarity(f, nargs);
+        funccode(f);
+        if (!inarena(f)) {
+            gcwrite(&consts[pc[2]], f);
+        }
+    }
+
+    e = bindv(f, nargs, argv);
+    code = f->func.code;
+
+    sp = vmsp = vmstack + frames[nframes-1].bp;
+    sp = vmreserve(sp, code->maxstack);
+
+    frames[nframes-1].code = code;
+    frames[nframes-1].env = e;
+    if (tracing) {
+        profdepth = frames[nframes-1].pdepth;
+        profpush(f);
+    }
+
+    env = e;
+    pc = code->insts;
+    consts = code->consts;
+    NEXT;
+}
+
+op_ret:
+    v = sp[-1];
+    profdepth = frames[nframes-1].pdepth;
+    nframes--;
+    sp = vmstack + frames[nframes].bp;
+
+    if (nframes == base) {
+        vmsp = sp;
+        return v;
+    }
+
+    *sp++ = v;
+    code = frames[nframes-1].code;
+    env = frames[nframes-1].env;
+    pc = frames[nframes-1].pc;
+    consts = code->consts;
+    NEXT;
+
+#undef NEXT
+#undef SYNC
+}
+
+// Calls f with already evaluated arguments.
+Value *
+vmapply(Value *f, Value *args)
+{
+    assert(is_function(f) || is_macro(f));
+
+    checkargs(f, args);
+
+    sig_atomic_t depth = profdepth;
+    if (tracing) {
+        profpush(f);
+    }
+
+    Value *v = vmrun(funccode(f), bind(f, args));
+
+    profdepth = depth;
+    return v;
+}
+
+// Evaluates an expanded and resolved top level form.
+Value *
+run(Value *v)
+{
+    if (treewalk) {
+        return eval(v, NULL);
+    } else {
+        return vmrun(compiletop(v), NULL);
+    }
+}
+
+int
+allints(int argc, Value **argv)
+{
+    for (int i = 0; i < argc; i++) {
+        if (!is_integer(argv[i])) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+#define builtin1(name) \
+    Value *builtin_##name(int argc, Value **argv) { \
+        return name(argv[0]); \
+    }
+
+#define builtin2(name) \
+    Value *builtin_##name(int argc, Value **argv) { \
+        return name(argv[0], argv[1]); \
+    }
+
+#define pred1(name) \
+    Value *builtin_is_##name(int argc, Value **argv) { \
+        return is_##name(argv[0]) ? s_t : NULL; \
+    }
+
+#define pred2(name) \
+    Value *builtin_is_##name(int argc, Value **argv) { \
+        return is_##name(argv[0], argv[1]) ? s_t : NULL; \
+    }
+
+// fn is one of the checked operations below. Results are checked
+// against the fixnum range at every step, not just at the end.
+#define op(fn, name, init) \
+    Value *builtin_##name(int argc, Value **argv) { \
+        if (!allints(argc, argv)) { return NULL; } \
+        if (argc == 0) { return mkint(init); } \
+        if (argc == 1) { return mkint(fn(init, intval(argv[0]))); } \
+        long long res = intval(argv[0]); \
+        for (int i = 1; i < argc; i++) { \
+            res = fn(res, intval(argv[i])); \
+        } \
+        return mkint(res); \
+    }
+
+#define comp(op, name) \
+    Value *builtin_##name(int argc, Value **argv) { \
+        if (!allints(argc, argv)) { return NULL; } \
+        for (int i = 1; i < argc; i++) { \
+            if (!(intval(argv[i-1]) op intval(argv[i]))) { \
+                return NULL; \
+            } \
+        } \
+        return t; \
+    }
+
+long long
+addint(long long x, long long y)
+{
+    long long res;
+    if (__builtin_add_overflow(x, y, &res) || res < FIXNUM_MIN || res > FIXNUM_MAX) {
+        overflow();
+    }
+    return res;
+}
+
+long long
+subint(long long x, long long y)
+{
+    long long res;
+    if (__builtin_sub_overflow(x, y, &res) || res < FIXNUM_MIN || res > FIXNUM_MAX) {
+        overflow();
+    }
+    return res;
+}
+
+long long
+mulint(long long x, long long y)
+{
+    long long res;
+    if (__builtin_mul_overflow(x, y, &res) || res < FIXNUM_MIN || res > FIXNUM_MAX) {
+        overflow();
+    }
+    return res;
+}
+
+// Only FIXNUM_MIN / -1 is out of range. Zero divisors are caught by
+// builtin_divide.
+long long
+divint(long long x, long long y)
+{
+    long long res = x / y;
+    if (res > FIXNUM_MAX) {
+        overflow();
+    }
+    return res;
+}
+
+builtin1(car)
+builtin1(cdr)
+builtin2(cons)
+
+Value *
+builtin_length(int argc, Value **argv)
+{
+    return mkint(length(argv[0]));
+}
+
+pred1(nil)
+pred1(symbol)
+pred1(string)
+pred1(integer)
+pred1(pair)
+pred1(function)
+pred1(builtin)
+pred1(procedure)
+
+pred2(eq)
+pred2(eqv)
+pred2(equal)
+
+op(addint, plus, 0)
+op(subint, minus, 0)
+op(mulint, times, 1)
+op(divint, divide_, 1)
+
+Value *
+builtin_divide(int argc, Value **argv)
+{
+    for (int i = 0; i < argc; i++) {
+        if (is_integer(argv[i]) && intval(argv[i]) == 0) {
+            fprintf(stderr, "/: division by zero\n");
+            exit(1);
+        }
+    }
+
+    return builtin_divide_(argc, argv);
+}
+
+comp(>, gt)
+comp(<, lt)
+comp(>=, ge)
+comp(<=, le)
+// == for the c operator, but = in def_op below for Lisp.
+// different from is_eq, which is eq?
+comp(==, eq)
+
+int readfasl(char *path, struct stat *st, uint64_t *hash, Value **entries);
+void writefasl(char *path, struct stat *st, uint64_t hash, Value *entries);
+int hashfile(char *path, size_t size, uint64_t *hash);
+
+// Expands and resolves form, a top level form of a file being loaded,
+// into *v. Returns what the fasl keeps of it, (expansion . deps), where
+// deps pairs each macro the expansion called with its fingerprint. Or
+// nil, so it's expanded again on every load, if a macro couldn't be
+// fingerprinted or the expansion had side effects, e.g. a macro that
+// defs something, since running a cached expansion would skip them.
+Value *
+expandform(Value *form, Value **v)
+{
+    Deps d = {0};
+    Deps *outer = deps;
+    size_t before = effects;
+
+    deps = &d;
+    arenaenter();
+    phase = PHASE_EXPAND;
+    *v = expand(form, NULL);
+    phase = PHASE_RESOLVE;
+    *v = resolve(*v, NULL);
+    *v = arenaexit(*v);
+    deps = outer;
+
+    Value *cached = NULL;
+    if (effects == before && !d.unknown) {
+        for (size_t i = d.n; i > 0; i--) {
+            cached = cons(cons(d.deps[i-1].sym, d.deps[i-1].fp), cached);
+        }
+        cached = cons(*v, cached);
+    }
+    free(d.deps);
+
+    return cached;
+}
+
+// Whether the expansion in a fasl entry can be run instead of expanding
+// the form again: it has one, and every macro it called still has the
+// fingerprint it had then.
+int
+reusable(Value *entry)
+{
+    if (!is_pair(cdr(entry))) {
+        return 0;
+    }
+
+    for (Value *l = cddr(entry); l != NULL; l = cdr(l)) {
+        if (fingerprint(caar(l)) != cdr(car(l))) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Runs the forms in the file at path. The fasl for a file has an entry
+// for each form, (offset . cached), where offset is where it starts in
+// the file and cached is what expandform returned. If the file hasn't
+// changed since, the expansions there are run instead, unless the
+// macros they called have changed. Those forms are read from their
+// offsets and expanded again, and the fasl is rewritten.
+Value *
+load(char *path)
+{
+    struct stat st;
+    Value *entries, *v;
+    Reader r;
+    uint64_t hash;
+    Phase oldphase = phase;
+    int wasexpanding = expanding; // if a macro loads something, what it defines is kept
+    expanding = 0;
+
+    if (stat(path, &st) == -1) {
+        fprintf(stderr, "load: can't open %s\n", path);
+        exit(1);
+    }
+
+    phase = PHASE_READ;
+    if (readfasl(path, &st, &hash, &entries)) {
+        int reading = 0, changed = 0;
+
+        for (Value *l = entries; l != NULL; l = cdr(l)) {
+            Value *entry = car(l);
+
+            if (reusable(entry)) {
+                v = cadr(entry);
+            } else {
+                if (!reading && !ropen(&r, path)) {
+                    fprintf(stderr, "load: can't open %s\n", path);
+                    exit(1);
+                }
+                reading = 1;
+
+                // it's mapped, or it wouldn't have been cached
+                r.p = r.buf + intval(car(entry));
+                Value *cached = expandform(readform(&r), &v);
+                changed |= cdr(entry) != NULL || cached != NULL;
+                gcwrite(&topair(entry)->cdr, cached);
+            }
+
+            phase = PHASE_EVAL;
+            run(v);
+            phase = PHASE_READ;
+        }
+
+        if (reading) {
+            rclose(&r);
+        }
+        if (changed) {
+            writefasl(path, &st, hash, entries);
+        }
+
+        phase = oldphase;
+        expanding = wasexpanding;
+        return NULL;
+    }
+
+    if (!ropen(&r, path) || !hashfile(path, st.st_size, &hash)) {
+        fprintf(stderr, "load: can't open %s\n", path);
+        exit(1);
+    }
 
-        Value *cdr = v->pair.cdr;
-        while (is_pair(cdr)) {
-            fprintf(stream, " ");
-            fprint0(stream, cdr->pair.car, depth+1);
-            cdr = cdr->pair.cdr;
-        }
+    Value *head = NULL, *tail = NULL;
 
-        if (!is_nil(cdr)) {
-            fprintf(stream, " . ");
-            fprint0(stream, cdr, depth+1);
+    while (peek(&r) != EOF) {
+        Value *off = mkint(r.p - r.buf);
+        Value *cell = cons(cons(off, expandform(readform(&r), &v)), NULL);
+        if (tail == NULL) {
+            head = cell;
+        } else {
+            gcwrite(&topair(tail)->cdr, cell);
         }
+        tail = cell;
 
-        fprintf(stream, ")");
-    } else {
-        fprintf(stdout, "print: unknown type\n");
-        exit(1);
+        phase = PHASE_EVAL;
+        run(v);
+        phase = PHASE_READ;
     }
 
-    if (depth == 0) {
-        fprintf(stream, "\n");
+    // Offsets are only good if the whole file was mapped. Otherwise it's
+    // empty, or something like a pipe, and not worth caching.
+    if (r.cap == 0) {
+        writefasl(path, &st, hash, head);
     }
+    rclose(&r);
+
+    phase = oldphase;
+    expanding = wasexpanding;
+    return NULL;
 }
 
-void
-fprint(FILE *stream, Value *v)
+Value *
+builtin_load(int argc, Value **argv)
 {
-    fprint0(stream, v, 0);
+    Value *path = argv[0];
+
+    if (!is_string(path)) {
+        fprintf(stderr, "load: path must be a string\n");
+        exit(1);
+    }
+
+    return load(path->str->s);
 }
 
-void
-print(Value *v)
+Value *
+statpair(char *name, size_t n, Value *rest)
 {
-    fprint(stdout, v);
+    return cons(cons(intern(name), mkint(n)), rest);
 }
 
+// An alist of the allocation and collection counters, with times in
+// microseconds. allocs is itself an alist of alloc calls by type, and
+// pauses a histogram of how long the program was stopped for, from
+// each bucket's upper bound in microseconds to the number of pauses.
 Value *
-builtin_print(Value *args)
+builtin_gc_stats(int argc, Value **argv)
 {
-    for (Value *v = args; !is_nil(v); v = cdr(v)) {
-        fprint(stdout, car(v));
+    // copied first, since building the result allocates
+    GCStats st = gcstats;
+    size_t counts[NTYPES];
+    memcpy(counts, allocs, sizeof(allocs));
+    size_t heap = heapused, limit = heapsize;
+
+    size_t nbytes = 0;
+    Value *types = NULL;
+    for (int t = NTYPES-1; t >= 0; t--) {
+        nbytes += counts[t]*typesizes[t];
+        types = statpair(typenames[t], counts[t], types);
     }
 
-    return NULL;
+    Value *l = NULL;
+    l = statpair("pinned-pages", st.pinned, l);
+    l = statpair("promoted", st.promoted, l);
+    l = statpair("released-bytes", st.released, l);
+    l = statpair("reclaimed-bytes", st.reclaimed, l);
+    Value *hist = NULL;
+    for (int i = NPAUSES-1; i >= 0; i--) {
+        if (hist != NULL || st.pauses[i] != 0) {
+            hist = cons(cons(mkint(1ll << i), mkint(st.pauses[i])), hist);
+        }
+    }
+
+    l = cons(cons(intern("pauses"), hist), l);
+    l = statpair("max-cpu-pause-us", st.maxcpupause*1e6, l);
+    l = statpair("max-pause-us", st.maxpause*1e6, l);
+    l = statpair("pause-target-us", incremental ? pausetarget*1e6 : 0, l);
+    l = statpair("gc-steps", st.steps, l);
+    l = statpair("arena-escapes", st.arenaescapes, l);
+    l = statpair("arena-bytes", st.arenabytes, l);
+    l = statpair("sweep-us", st.sweeptime*1e6, l);
+    l = statpair("mark-us", st.marktime*1e6, l);
+    l = statpair("parallel-gcs", st.parallel, l);
+    l = statpair("gc-threads", gcthreads, l);
+    l = statpair("minor-gc-us", st.minortime*1e6, l);
+    l = statpair("gc-us", st.gctime*1e6, l);
+    l = statpair("minor-gcs", st.minorgcs, l);
+    l = statpair("gcs", st.gcs, l);
+    l = statpair("heap-grows", st.grows, l);
+    l = statpair("heap-limit-bytes", limit, l);
+    l = statpair("heap-bytes", heap, l);
+    l = statpair("gcmalloc-bytes", st.mallocbytes, l);
+    l = statpair("gcmalloc-calls", st.mallocs, l);
+    l = statpair("alloc-bytes", nbytes, l);
+
+    return cons(cons(intern("allocs"), types), l);
 }
 
-int
-peek(FILE *stream)
+// For LC_GCSTATS.
+void
+printgcstats(void)
 {
-    int c = fgetc(stream);
-    if (c == EOF) {
-        return EOF;
+    GCStats *st = &gcstats;
+
+    fprintf(stderr, "gc: %zu collections and %zu minor ones, %.3fs total, %.3fms longest pause (%.3fms of CPU)\n",
+        st->gcs, st->minorgcs, st->gctime + st->minortime, st->maxpause*1e3, st->maxcpupause*1e3);
+    fprintf(stderr, "gc: %.1f MB heap, %.1f MB limit after %zu grows, %.1f MB reclaimed, %.1f MB released\n",
+        heapused/1e6, heapsize/1e6, st->grows, st->reclaimed/1e6, st->released/1e6);
+    fprintf(stderr, "gc: %.3fs marking and %.3fs sweeping in full collections, %zu of them by %d threads\n",
+        st->marktime, st->sweeptime, st->parallel, gcthreads);
+    if (st->arenabytes > 0) {
+        fprintf(stderr, "gc: %.1f MB of expansion temporaries made in the arena, %zu of them copied out for slots outside it\n",
+            st->arenabytes/1e6, st->arenaescapes);
     }
-
-    int res = ungetc(c, stream);
-    if (res == EOF) {
-        fprintf(stderr, "couldn't peek\n");
-        exit(1);
+    if (incremental) {
+        fprintf(stderr, "gc: %zu incremental steps of at most %.0fus\n", st->steps, pausetarget*1e6);
     }
-    return c;
+    fprintf(stderr, "gc: pauses");
+    for (int i = 0; i < NPAUSES; i++) {
+        if (st->pauses[i] != 0) {
+            fprintf(stderr, " <%lluus %zu", 1ull << i, st->pauses[i]);
+        }
+    }
+    fprintf(stderr, "\n");
+    fprintf(stderr, "gc: %zu objects promoted from the nursery, %zu pages pinned\n",
+        st->promoted, st->pinned);
+    fprintf(stderr, "gc: %zu gcmalloc calls, %.1f MB\n", st->mallocs, st->mallocbytes/1e6);
+
+    fprintf(stderr, "alloc:");
+    for (int t = 0; t < NTYPES; t++) {
+        fprintf(stderr, " %s %zu", typenames[t], allocs[t]);
+    }
+    fprintf(stderr, "\n");
 }
 
-int
-xungetc(int c, FILE *stream)
+Value *builtin_heap_snapshot(int argc, Value **argv);
+
+#define def_builtin(name, min, max) {#name, builtin_##name, min, max}
+#define def_pred(name, n) {#name "?", builtin_is_##name, n, n}
+#define def_op(op, name, min) {#op, builtin_##name, min, VARIADIC}
+
+// Every builtin, which main defines as globals. Images refer to these
+// by name.
+Builtin builtins[] = {
+    def_builtin(car, 1, 1),
+    def_builtin(cdr, 1, 1),
+    def_builtin(cons, 2, 2),
+    def_builtin(length, 1, 1),
+
+    def_pred(nil, 1),
+    def_pred(symbol, 1),
+    def_pred(string, 1),
+    def_pred(integer, 1),
+    def_pred(pair, 1),
+    def_pred(function, 1),
+    def_pred(builtin, 1),
+    def_pred(procedure, 1),
+
+    def_pred(eq, 2),
+    def_pred(eqv, 2),
+    def_pred(equal, 2),
+
+    def_builtin(print, 0, VARIADIC),
+    def_builtin(load, 1, 1),
+    {"gc-stats", builtin_gc_stats, 0, 0},
+    {"heap-snapshot", builtin_heap_snapshot, 1, 1},
+
+    def_op(+, plus, 0),
+    def_op(-, minus, 0),
+    def_op(*, times, 0),
+    def_op(/, divide, 1),
+
+    def_op(>, gt, 0),
+    def_op(<, lt, 0),
+    def_op(>=, ge, 0),
+    def_op(<=, le, 0),
+    // = for Lisp land, but == above in comp for the C operator.
+    def_op(=, eq, 0),
+};
+size_t nbuiltins = sizeof(builtins)/sizeof(builtins[0]);
+
+// An open addressing table from addresses to offsets or indexes, used
+// by dumps and the heap profiler.
+typedef struct AddrMap AddrMap;
+struct AddrMap {
+    uintptr_t *keys; // 0 for unused entries
+    size_t *vals;
+    size_t cap; // always a power of two
+    size_t n;
+};
+
+// Returns the value for p, or NULL if p isn't in m.
+size_t *
+addrfind(AddrMap *m, void *p)
 {
-    int res = ungetc(c, stream);
-    if (res == EOF) {
-        fprintf(stderr, "couldn't ungetc\n");
-        exit(1);
+    if (m->cap == 0) {
+        return NULL;
     }
-    return res;
+
+    uintptr_t key = (uintptr_t)p;
+    size_t i = hashname((char *)&key, sizeof(key)) & (m->cap-1);
+
+    for (; m->keys[i] != 0; i = (i+1) & (m->cap-1)) {
+        if (m->keys[i] == key) {
+            return &m->vals[i];
+        }
+    }
+
+    return NULL;
 }
 
-void
-skipspace(FILE *stream)
+// Returns the value for p, adding it as (size_t)-1 if it isn't in m.
+size_t *
+addrslot(AddrMap *m, void *p)
 {
-    int c, comment = 0;
+    if (2*(m->n+1) > m->cap) {
+        uintptr_t *keys = m->keys;
+        size_t *vals = m->vals;
+        size_t cap = m->cap;
+
+        m->cap = cap ? cap*2 : 4096;
+        m->keys = xalloc(m->cap*sizeof(uintptr_t));
+        m->vals = xalloc(m->cap*sizeof(size_t));
+
+        for (size_t i = 0; i < cap; i++) {
+            if (keys[i] == 0) {
+                continue;
+            }
 
-    while ((c = peek(stream)) != EOF) {
-        if (c == ';') {
-            comment = 1;
+            size_t j = hashname((char *)&keys[i], sizeof(uintptr_t)) & (m->cap-1);
+            while (m->keys[j] != 0) {
+                j = (j+1) & (m->cap-1);
+            }
+            m->keys[j] = keys[i];
+            m->vals[j] = vals[i];
         }
 
-        if (!isspace(c) && !comment) {
-            return;
-        }
+        free(keys);
+        free(vals);
+    }
 
-        fgetc(stream);
+    uintptr_t key = (uintptr_t)p;
+    size_t i = hashname((char *)&key, sizeof(key)) & (m->cap-1);
 
-        if (c == '\n') {
-            comment = 0;
+    for (; m->keys[i] != 0; i = (i+1) & (m->cap-1)) {
+        if (m->keys[i] == key) {
+            return &m->vals[i];
         }
     }
-}
 
-Value *read(FILE *stream);
+    m->keys[i] = key;
+    m->vals[i] = (size_t)-1;
+    m->n++;
 
-Value *
-readlist(FILE *stream, int first)
+    return &m->vals[i];
+}
+
+void
+addrfree(AddrMap *m)
 {
-    skipspace(stream);
+    free(m->keys);
+    free(m->vals);
+}
 
-    int c = peek(stream);
+// Heap images and fasls. --dump-image writes every object reachable
+// from the symbol table to a file, and --image loads it instead of
+// defining the builtins and loading lib.lisp. load caches the forms of
+// each file it loads in a fasl next to it, so it needn't read the file
+// again if it hasn't changed, along with their expansions, which it
+// runs instead of expanding them again if the macros they called
+// haven't changed either.
+//
+// Both are dumps. The objects are laid out back to back as they'd be in
+// memory, with pointers stored as offsets from the start of the object
+// area and a table of which words hold them. Loading copies the area
+// into a single gcmalloc block and adds the block's address to each of
+// those words. The collector treats the block like any other: it's live
+// as long as anything points into it, and everything it points to is
+// scanned. Builtins are stored by name and their imps are looked up in
+// builtins when loading, since code addresses differ between runs.
+//
+// A fasl has to share symbols with everything else that's running, so
+// it stores them by name too, and they're interned when it's loaded.
+
+#define DUMP_VERSION 4
+#define IMAGE_MAGIC "lcimage"
+#define FASL_MAGIC "lcfasl"
+
+typedef struct DumpHeader DumpHeader;
+struct DumpHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t valuesize; // catches dumps from builds with other layouts
+    uint64_t size; // of the object area
+    uint64_t nrelocs;
+    uint64_t nbuiltins;
+    uint64_t nsymrefs;
+    uint64_t root; // the symbol table in an image, a word holding the entries in a fasl
+
+    // images only
+    uint64_t symtabcap;
+    uint64_t nsyms;
+
+    // fasls only, the source file it was made from
+    int64_t mtime; // in nanoseconds
+    uint64_t srcsize;
+    uint64_t srchash;
+};
 
-    if (c == EOF) {
-        fprintf(stderr, "expected value or ')' but got EOF\n");
-        exit(1);
-    } else if (c == ')') {
-        // TODO: error handling
-        fgetc(stream);
-        return NULL;
-    } else if (c == '.' && !first) {
-        // TODO: error handling
-        c = fgetc(stream);
-
-        Value *cdr = read(stream);
-        skipspace(stream);
-        int c = fgetc(stream);
-        if (c != ')') {
-            fprintf(stderr, "expected ')' but got '%c'\n", c);
-            exit(1);
-        }
+enum DumpKind {
+    D_VALUE,
+    D_PAIR,
+    D_ENV,
+    D_CODE,
+    D_BUF,
+    D_BYTES,
+};
+typedef enum DumpKind DumpKind;
 
-        return cdr;
-    } else {
-        Value *car = read(stream);
-        Value *cdr = readlist(stream, 0);
-        return cons(car, cdr);
-    }
-}
+typedef struct Pending Pending;
+struct Pending {
+    void *p;
+    DumpKind kind;
+    size_t off;
+};
 
-int
-is_symchar(int c)
-{
-    return !isspace(c) && c != '(' && c != ')' && c != '.';
-}
+typedef struct Dump Dump;
+struct Dump {
+    char *out; // the object area
+    size_t len;
+    size_t cap;
 
-int
-is_symstart(int c)
+    AddrMap map; // where each object has been put
+
+    // objects that have been copied but whose pointers haven't been
+    // converted to offsets yet
+    Pending *pending;
+    size_t npending;
+    size_t pendingcap;
+
+    uint64_t *relocs;
+    size_t nrelocs;
+    size_t reloccap;
+
+    uint64_t *builtins; // offsets of BUILTIN values
+    size_t nbuiltins;
+    size_t builtinscap;
+
+    int bynames; // store symbols as references to their names
+    uint64_t *symrefs; // words holding the offset of a symbol's name
+    size_t nsymrefs;
+    size_t symrefscap;
+};
+
+void
+dumpu64(uint64_t **a, size_t *n, size_t *cap, uint64_t x)
 {
-    return is_symchar(c) && !isdigit(c);
+    if (*n == *cap) {
+        *cap = *cap ? *cap*2 : 1024;
+        *a = xrealloc(*a, *cap*sizeof(uint64_t));
+    }
+    (*a)[(*n)++] = x;
 }
 
-#define MAX_INTLEN 20 // includes optional leading -
-#define MAX_SYMLEN 1024
-
-long long
-parseint(char *s)
+size_t
+dumpsize(void *p, DumpKind kind)
 {
-    long long n = strtoll(s, NULL, 10);
-    if (errno == ERANGE) {
-        fprintf(stderr, "integer too big '%s'\n", s);
-        exit(1);
+    switch (kind) {
+    case D_VALUE:
+        return typesizes[((Value *)p)->type];
+    case D_PAIR:
+        return sizeof(Pair);
+    case D_ENV:
+        return sizeof(Env) + ((Env *)p)->nslots*sizeof(Value *);
+    case D_CODE: {
+        Code *c = p;
+        return sizeof(Code) + c->nconsts*sizeof(Value *) + c->ninsts*sizeof(int);
+    }
+    case D_BUF:
+        return sizeof(Buf);
+    default:
+        assert(0);
     }
-    return n;
 }
 
-Value *
-read(FILE *stream)
+// Returns the offset of p's copy in the object area, copying it there
+// if it hasn't been already. size is only used for D_BYTES.
+size_t
+dumpobj(Dump *d, void *p, DumpKind kind, size_t size)
 {
-    skipspace(stream);
+    size_t *slot = addrslot(&d->map, p);
+    if (*slot != (size_t)-1) {
+        return *slot;
+    }
 
-    int c = fgetc(stream);
-    if (c == EOF) {
-        return NULL;
-    } else if (c == '(') {
-        return readlist(stream, 1);
-    } else if (c == '\'') {
-        return cons(s_quote, cons(read(stream), NULL));
-    } else if (c == '`') {
-        return cons(s_quasiquote, cons(read(stream), NULL));
-    } else if (c == ',') {
-        // TODO error check on peek and fgetc
-
-        if (peek(stream) == '@') {
-            fgetc(stream);
-            return cons(s_unquote_splicing, cons(read(stream), NULL));
-        } else {
-            return cons(s_unquote, cons(read(stream), NULL));
-        }
-    } else if (c == '"') {
-        Buf *b = binit("");
+    if (kind != D_BYTES) {
+        size = dumpsize(p, kind);
+    }
 
-        while (1) {
-            c = fgetc(stream);
-            if (c == EOF) {
-                fprintf(stderr, "unterminated string\n");
-                exit(1);
-            } else if (c == '"') {
-                break;
-            } else if (c == '\\') {
-                c = fgetc(stream);
-                if (c == EOF) {
-                    fprintf(stderr, "unterminated string\n");
-                    exit(1);
-                } else if (c == 'n') {
-                    c = '\n';
-                } else if (c == 't') {
-                    c = '\t';
-                } else if (c == 'r') {
-                    c = '\r';
-                } else if (c == '\\') {
-                    c = '\\';
-                } else if (c == '"') {
-                    c = '"';
-                } else {
-                    fprintf(stderr, "unknown escape sequence '\\%c'\n", c);
-                    exit(1);
-                }
-            }
+    // keep everything 16 byte aligned, which is plenty for any object
+    size_t off = (d->len + 15) / 16 * 16;
 
-            bputc(b, c);
+    if (off + size > d->cap) {
+        while (off + size > d->cap) {
+            d->cap = d->cap ? d->cap*2 : 1024*1024;
         }
+        d->out = xrealloc(d->out, d->cap);
+    }
 
-        return mkstring(b);
-    } else if ((c == '-' && isdigit(peek(stream))) || isdigit(c)) {
-        char buf[MAX_INTLEN+1];
+    memset(d->out + d->len, 0, off - d->len);
+    memcpy(d->out + off, p, size);
+    d->len = off + size;
+    *slot = off;
 
-        int i = 0;
-        do {
-            if (i == MAX_INTLEN) {
-                fprintf(stderr, "integer too long\n");
-                exit(1);
-            }
-            buf[i++] = c;
-            c = fgetc(stream);
-        } while (isdigit(c));
+    if (kind != D_BYTES) {
+        if (d->npending == d->pendingcap) {
+            d->pendingcap = d->pendingcap ? d->pendingcap*2 : 1024;
+            d->pending = xrealloc(d->pending, d->pendingcap*sizeof(Pending));
+        }
+        d->pending[d->npending++] = (Pending){p, kind, off};
+    }
 
-        buf[i] = '\0';
-        xungetc(c, stream);
+    return off;
+}
 
-        return mkint(parseint(buf));
-    } else if (is_symstart(c)) {
-        char buf[MAX_SYMLEN+1];
+// Stores the offset of target's copy in the pointer at off.
+void
+dumpptr(Dump *d, size_t off, void *target, DumpKind kind, size_t size)
+{
+    void *p = target; // NULL and fixnums are written as is
+
+    if (d->bynames && kind == D_VALUE && is_symbol(target)) {
+        Value *sym = target;
+        p = (void *)dumpobj(d, sym->sym.name, D_BYTES, sym->sym.len + 1);
+        dumpu64(&d->symrefs, &d->nsymrefs, &d->symrefscap, off);
+    } else if (kind == D_VALUE && is_pair(target)) {
+        // the tag survives relocation, since the base is aligned
+        p = (void *)(dumpobj(d, topair(target), D_PAIR, 0) + PAIRTAG);
+        dumpu64(&d->relocs, &d->nrelocs, &d->reloccap, off);
+    } else if (target != NULL && !(kind == D_VALUE && is_integer(target))) {
+        p = (void *)dumpobj(d, target, kind, size);
+        dumpu64(&d->relocs, &d->nrelocs, &d->reloccap, off);
+    }
 
-        int i;
-        for (i = 0; is_symchar(c); i++) {
-            buf[i] = c;
-            c = fgetc(stream);
+    memcpy(d->out + off, &p, sizeof(p));
+}
 
-            if (i == MAX_SYMLEN) {
-                fprintf(stderr, "symbol too long\n");
-                exit(1);
-            }
+#define FIELD(type, field) (pd.off + offsetof(type, field))
+
+void
+dumpfields(Dump *d, Pending pd)
+{
+    if (pd.kind == D_VALUE) {
+        Value *v = pd.p;
+
+        switch (v->type) {
+        case SYMBOL:
+            dumpptr(d, FIELD(Value, sym.name), v->sym.name, D_BYTES, v->sym.len + 1);
+            dumpptr(d, FIELD(Value, sym.value), v->sym.value, D_VALUE, 0);
+            break;
+        case STRING:
+            dumpptr(d, FIELD(Value, str), v->str, D_BUF, 0);
+            break;
+        case BUILTIN:
+            dumpptr(d, FIELD(Value, builtin.name), v->builtin.name, D_BYTES, strlen(v->builtin.name) + 1);
+            dumpptr(d, FIELD(Value, builtin.imp), NULL, D_BYTES, 0);
+            dumpu64(&d->builtins, &d->nbuiltins, &d->builtinscap, pd.off);
+            break;
+        case FUNCTION:
+        case MACRO:
+            dumpptr(d, FIELD(Value, func.name), v->func.name, D_VALUE, 0);
+            dumpptr(d, FIELD(Value, func.params), v->func.params, D_VALUE, 0);
+            dumpptr(d, FIELD(Value, func.body), v->func.body, D_VALUE, 0);
+            dumpptr(d, FIELD(Value, func.env), v->func.env, D_ENV, 0);
+            dumpptr(d, FIELD(Value, func.code), v->func.code, D_CODE, 0);
+            break;
+        case LOCAL:
+            dumpptr(d, FIELD(Value, local.name), v->local.name, D_VALUE, 0);
+            break;
+        default:
+            fprintf(stderr, "dump: unexpected type %d\n", v->type);
+            exit(1);
         }
+    } else if (pd.kind == D_PAIR) {
+        Pair *p = pd.p;
 
-        buf[i] = '\0';
-        xungetc(c, stream);
+        dumpptr(d, FIELD(Pair, car), p->car, D_VALUE, 0);
+        dumpptr(d, FIELD(Pair, cdr), p->cdr, D_VALUE, 0);
+    } else if (pd.kind == D_ENV) {
+        Env *e = pd.p;
 
-        Value *sym = intern(buf);
+        dumpptr(d, FIELD(Env, parent), e->parent, D_ENV, 0);
+        for (int i = 0; i < e->nslots; i++) {
+            dumpptr(d, FIELD(Env, slots) + i*sizeof(Value *), e->slots[i], D_VALUE, 0);
+        }
+    } else if (pd.kind == D_CODE) {
+        Code *c = pd.p;
 
-        if (sym == s_nil) {
-            return NULL;
-        } else {
-            return sym;
+        // insts points into the Code itself
+        size_t insts = pd.off + ((char *)c->insts - (char *)c);
+        memcpy(d->out + FIELD(Code, insts), &insts, sizeof(insts));
+        dumpu64(&d->relocs, &d->nrelocs, &d->reloccap, FIELD(Code, insts));
+
+        for (int i = 0; i < c->nconsts; i++) {
+            dumpptr(d, FIELD(Code, consts) + i*sizeof(Value *), c->consts[i], D_VALUE, 0);
         }
-    } else {
-        fprintf(stderr, "unexpected character: %c\n", c);
-        exit(1);
+    } else if (pd.kind == D_BUF) {
+        Buf *b = pd.p;
+        dumpptr(d, FIELD(Buf, s), b->s, D_BYTES, b->cap);
     }
 }
 
-int
-is_eq(Value *x, Value *y)
+#undef FIELD
+
+// Converts everything that's been copied so far. The list is used as a
+// stack, so this doesn't recurse. Offsets are all that's kept, since
+// d->out moves as it grows.
+void
+dumpall(Dump *d)
 {
-    return x == y;
+    while (d->npending > 0) {
+        dumpfields(d, d->pending[--d->npending]);
+    }
 }
 
 int
-is_eqv(Value *x, Value *y)
+xfwrite(void *p, size_t size, FILE *f)
 {
-    if (is_integer(x) && is_integer(y)) {
-        return x->n == y->n;
-    } else {
-        return is_eq(x, y);
-    }
+    return size == 0 || fwrite(p, size, 1, f) == 1;
 }
 
+// Writes d to path with the header h, whose magic and root the caller
+// fills in, and frees d. Returns 0 if the file couldn't be written.
 int
-is_equal(Value *x, Value *y)
+writedump(Dump *d, DumpHeader *h, char *path)
 {
-    if (is_pair(x) && is_pair(y)) {
-        return is_equal(car(x), car(y)) && is_equal(cdr(x), cdr(y));
-    } else {
-        return is_eqv(x, y);
+    h->version = DUMP_VERSION;
+    h->valuesize = sizeof(Value);
+    h->size = d->len;
+    h->nrelocs = d->nrelocs;
+    h->nbuiltins = d->nbuiltins;
+    h->nsymrefs = d->nsymrefs;
+
+    int ok = 0;
+    FILE *f = fopen(path, "w");
+
+    if (f != NULL) {
+        ok = xfwrite(h, sizeof(*h), f) &&
+            xfwrite(d->out, d->len, f) &&
+            xfwrite(d->relocs, d->nrelocs*sizeof(uint64_t), f) &&
+            xfwrite(d->builtins, d->nbuiltins*sizeof(uint64_t), f) &&
+            xfwrite(d->symrefs, d->nsymrefs*sizeof(uint64_t), f);
+        ok = fclose(f) == 0 && ok;
     }
+
+    free(d->out);
+    addrfree(&d->map);
+    free(d->pending);
+    free(d->relocs);
+    free(d->builtins);
+    free(d->symrefs);
+
+    return ok;
 }
 
-Value *
-assoc(Value *v, Value *l)
+void
+dumpimage(char *path)
 {
-    if (!is_pair(l) && !is_nil(l)) {
-        fprintf(stderr, "assoc: expected list\n");
-        exit(1);
+    Dump d = {0};
+
+    size_t tab = dumpobj(&d, symtab, D_BYTES, symtabcap*sizeof(Value *));
+    for (size_t i = 0; i < symtabcap; i++) {
+        dumpptr(&d, tab + i*sizeof(Value *), symtab[i], D_VALUE, 0);
     }
+    dumpall(&d);
 
-    while (!is_nil(l)) {
-        if (is_equal(caar(l), v)) {
-            return car(l);
-        }
+    DumpHeader h = {
+        .magic = IMAGE_MAGIC,
+        .root = tab,
+        .symtabcap = symtabcap,
+        .nsyms = nsyms,
+    };
 
-        l = cdr(l);
+    if (!writedump(&d, &h, path)) {
+        fprintf(stderr, "dump: can't write %s\n", path);
+        exit(1);
     }
-
-    return NULL;
 }
 
-Value *
-append(Value *x, Value *y)
+// Maps the dump at path and checks that it's a complete one with the
+// given magic, written by this build. Returns NULL and sets err to why
+// if it isn't. The caller unmaps it.
+char *
+mapdump(char *path, char *magic, DumpHeader *h, size_t *len, char **err)
 {
-    if (is_nil(x)) {
-        return y;
-    } else {
-        return cons(car(x), append(cdr(x), y));
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        *err = "can't open";
+        return NULL;
     }
-}
 
-int
-length(Value *l)
-{
-    if (!is_pair(l)) {
-        return 0;
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED || (size_t)st.st_size < sizeof(*h)) {
+        if (map != MAP_FAILED) {
+            munmap(map, st.st_size);
+        }
+        *err = "can't read";
+        return NULL;
     }
+    memcpy(h, map, sizeof(*h));
 
-    int len = 0;
-    for (; l != NULL; l = cdr(l)) {
-        len++;
+    if (strncmp(h->magic, magic, sizeof(h->magic)) != 0 || h->version != DUMP_VERSION || h->valuesize != sizeof(Value)) {
+        munmap(map, st.st_size);
+        *err = "wasn't written by this build";
+        return NULL;
     }
 
-    return len;
+    if (sizeof(*h) + h->size + (h->nrelocs + h->nbuiltins + h->nsymrefs)*sizeof(uint64_t) != (size_t)st.st_size) {
+        munmap(map, st.st_size);
+        *err = "is truncated";
+        return NULL;
+    }
+
+    *len = st.st_size;
+    return map;
 }
 
-void
-checkargs(Value *name, Value *params, Value *args)
+// Copies the object area of a mapped dump into the heap and turns its
+// offsets, builtins and symbol names back into pointers.
+char *
+undump(char *map, DumpHeader *h)
 {
-    // if it's a symbol, capture everything
-    if (is_symbol(params)) {
-        return;
+    char *base = gcmalloc(h->size);
+    memcpy(base, map + sizeof(*h), h->size);
+
+    uint64_t *relocs = (uint64_t *)(map + sizeof(*h) + h->size);
+    for (uint64_t i = 0; i < h->nrelocs; i++) {
+        uintptr_t *p = (uintptr_t *)(base + relocs[i]);
+        *p += (uintptr_t)base;
     }
 
-    int nargs = 0;
-    int varargs = 0;
+    uint64_t *bs = relocs + h->nrelocs;
+    for (uint64_t i = 0; i < h->nbuiltins; i++) {
+        Builtin *b = &((Value *)(base + bs[i]))->builtin;
+        Builtin *found = NULL;
 
-    for (Value *p = params; is_pair(p); p = cdr(p)) {
-        nargs += 1;
+        for (size_t j = 0; j < nbuiltins; j++) {
+            if (strcmp(builtins[j].name, b->name) == 0) {
+                found = &builtins[j];
+            }
+        }
 
-        if (is_symbol(cdr(p))) {
-            varargs = 1;
+        if (found == NULL) {
+            fprintf(stderr, "undump: unknown builtin %s\n", b->name);
+            exit(1);
         }
+        *b = *found;
     }
 
-    int len = length(args);
-
-    if (len < nargs && varargs) {
-        fprintf(stderr, "%s: expected %d or more arguments, got %d\n", name->sym, nargs, len);
-        exit(1);
-    } else if (len != nargs && !varargs) {
-        fprintf(stderr, "%s: expected %d arguments, got %d\n", name->sym, nargs, len);
-        exit(1);
+    // The symbols are old objects, so these don't need gcwrite.
+    uint64_t *syms = bs + h->nbuiltins;
+    for (uint64_t i = 0; i < h->nsymrefs; i++) {
+        Value **p = (Value **)(base + syms[i]);
+        *p = intern(base + (uintptr_t)*p);
     }
+
+    return base;
 }
 
-Value *
-zipargs(Value *x, Value *y)
+void
+loadimage(char *path)
 {
-    if (is_nil(x) && is_nil(y)) {
-        return NULL;
-    } else if (is_symbol(x)) {
-        return cons(cons(x, cons(y, NULL)), NULL);
-    } else if (is_pair(x) && is_pair(y)) {
-        return cons(cons(car(x), cons(car(y), NULL)), zipargs(cdr(x), cdr(y)));
-    } else if (is_nil(x) || is_nil(y)) {
-        fprintf(stderr, "zipargs: lists not the same length\n");
-        exit(1);
-    } else {
-        fprintf(stderr, "zipargs: expected list\n");
+    DumpHeader h;
+    size_t len;
+    char *err;
+
+    char *map = mapdump(path, IMAGE_MAGIC, &h, &len, &err);
+    if (map == NULL) {
+        fprintf(stderr, "image: %s %s\n", path, err);
         exit(1);
     }
+
+    char *base = undump(map, &h);
+    munmap(map, len);
+
+    symtab = (Value **)(base + h.root);
+    symtabcap = h.symtabcap;
+    nsyms = h.nsyms;
+    gcroot(&symtab);
 }
 
-Env *
-clone(Env *env)
+char *
+faslpath(char *path)
 {
-    Env *newenv = xalloc(sizeof(Env));
-    newenv->parent = env;
-    newenv->bindings = NULL;
-    return newenv;
+    char *fasl = xalloc(strlen(path) + sizeof(".fasl"));
+    sprintf(fasl, "%s.fasl", path);
+    return fasl;
 }
 
-// Returns a binding, e.g. '(x 1)
-Value *
-lookup(Value *name, Env *env)
+int64_t
+mtime(struct stat *st)
 {
-    Value *v;
+    return (int64_t)st->st_mtim.tv_sec*1000000000 + st->st_mtim.tv_nsec;
+}
 
-    for (; env != NULL; env = env->parent) {
-        v = assoc(name, env->bindings);
-        if (v) {
-            return v;
-        }
+int
+hashfile(char *path, size_t size, uint64_t *hash)
+{
+    if (size == 0) {
+        *hash = hashname("", 0);
+        return 1;
     }
 
-    return NULL;
-}
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
 
-// Returns a value instead of a binding. Can't differentiate
-// between name being unbound and name being bound to nil.
-Value *
-lookupv(Value *name, Env *env)
-{
-    return cadr(lookup(name, env));
-}
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
 
-void
-setname(Value *name, Value *value)
-{
-    if (is_function(value) || is_macro(value)) {
-        value->func.name = name;
+    if (map == MAP_FAILED) {
+        return 0;
     }
-}
 
-Value *
-def(Value *name, Value *value, Env *env)
-{
-    env->bindings = cons(cons(name, cons(value, NULL)), env->bindings);
-    setname(name, value);
-    return value;
-}
+    *hash = hashname(map, size);
+    munmap(map, size);
 
-Value **evalslot(Value *v, Env *env);
+    return 1;
+}
 
-Value *
-set(Value *lval, Value *value, Env *env)
+// Sets entries to the list of expandform entries cached for the file at
+// path, whose stat is st, and hash to the hash of its contents. Returns
+// 0 if there's no fasl for it or the file has changed since it was
+// written. A new mtime alone isn't a change if the contents hash the
+// same.
+int
+readfasl(char *path, struct stat *st, uint64_t *hash, Value **entries)
 {
-    Value **slot = evalslot(lval, env);
-
-    if (slot == NULL && is_symbol(lval)) {
-        fprintf(stderr, "set: undefined variable: %s\n", lval->sym);
-        exit(1);
-    } else if (slot == NULL) {
-        fprintf(stderr, "set: invalid location: ");
-        fprint(stderr, lval);
-        exit(1);
-    }
+    char *fasl = faslpath(path);
+    DumpHeader h;
+    size_t len;
+    char *err;
 
-    *slot = value;
+    char *map = mapdump(fasl, FASL_MAGIC, &h, &len, &err);
+    free(fasl);
 
-    if (is_symbol(lval)) {
-        setname(lval, value);
+    if (map == NULL) {
+        return 0;
+    }
+
+    if (h.srcsize != (uint64_t)st->st_size || (h.mtime != mtime(st) && !(hashfile(path, st->st_size, hash) && *hash == h.srchash))) {
+        munmap(map, len);
+        return 0;
     }
 
-    return value;
+    char *base = undump(map, &h);
+    munmap(map, len);
+
+    *hash = h.srchash;
+    *entries = *(Value **)(base + h.root);
+    return 1;
 }
 
-Value*
-quotelist(Value *l)
+// Caches entries, the expandform entries of the file at path, whose
+// stat is st and whose contents hash to hash. Written to a temporary file and
+// renamed so nobody sees half of it. It's only a cache, so failing to
+// write it isn't an error.
+void
+writefasl(char *path, struct stat *st, uint64_t hash, Value *entries)
 {
-    assert(is_pair(l) || is_nil(l));
+    Dump d = {0};
+    d.bynames = 1;
+
+    size_t root = dumpobj(&d, &entries, D_BYTES, sizeof(entries));
+    dumpptr(&d, root, entries, D_VALUE, 0);
+    dumpall(&d);
+
+    DumpHeader h = {
+        .magic = FASL_MAGIC,
+        .root = root,
+        .mtime = mtime(st),
+        .srcsize = st->st_size,
+        .srchash = hash,
+    };
 
-    if (is_pair(l)) {
-        return cons(cons(s_quote, cons(car(l), NULL)), quotelist(cdr(l)));
-    } else {
-        return NULL;
+    char *fasl = faslpath(path);
+    char *tmp = xalloc(strlen(fasl) + 32);
+    sprintf(tmp, "%s.%d", fasl, (int)getpid());
+
+    if (!writedump(&d, &h, tmp) || rename(tmp, fasl) == -1) {
+        unlink(tmp);
     }
-}
 
-Value *evlis(Value *params, Env *env);
-Value *eval(Value *v, Env *env);
+    free(tmp);
+    free(fasl);
+}
 
-Value *
-apply(Value *f, Value *args, Env *env)
+// The heap profiler. With --heap-profile, alloc and mkframe tag each
+// object with the function that allocated it: the innermost function on
+// profstack, or the builtin that's running if it was called from the
+// top level, or the phase if nothing is. A tag is an index into
+// sitenames, kept off to the side with the rest of the object's
+// metadata: in its page's sites array, or in its Large. So freeing an
+// object costs nothing, and the tags take space in proportion to the
+// heap. evacuate moves an object's tag along with it, and gcmalloc
+// clears the tag of a block it hands out again, so a tag never outlives
+// its object.
+//
+// (heap-snapshot path) walks everything reachable from the symbol table,
+// the gcroots and the VM's stack and frames, and writes the live bytes
+// to path grouped by type and allocation site. Each group comes with
+// the shortest retention path to one of its objects. Values that are
+// only held in C locals, e.g. by the tree-walker, aren't seen.
+
+char **sitenames; // by tag; 0 is for untagged objects
+size_t nsitenames = 1;
+size_t sitenamescap;
+AddrMap siteids; // names to tags
+
+char *
+sitename(void)
 {
-    assert(is_function(f) || is_macro(f));
+    int depth = profdepth < PROFSTACK ? profdepth : PROFSTACK;
 
-    checkargs(f->func.name, f->func.params, args);
-    Value *bindings = zipargs(f->func.params, evlis(args, env));
-    Env *newenv = clone(f->func.env);
-    newenv->bindings = bindings;
+    for (int i = depth-1; i >= 0; i--) {
+        if (!is_builtin(profstack[i])) {
+            return profname(profstack[i]);
+        }
+    }
 
-    Value *res;
-    for (Value *e = f->func.body; is_pair(e); e = cdr(e)) {
-        res = eval(car(e), newenv);
+    if (depth > 0) {
+        return profname(profstack[depth-1]);
     }
 
-    return res;
+    return phasenames[phase];
 }
 
-Value *expand(Value *v, Env *env);
-
-Value *
-expandlist(Value *l, Env *env)
+uint32_t
+siteid(char *name)
 {
-    if (is_pair(l)) {
-        return cons(expand(car(l), env), expandlist(cdr(l), env));
-    } else {
-        return l;
+    size_t *id = addrslot(&siteids, name);
+
+    if (*id == (size_t)-1) {
+        if (nsitenames >= sitenamescap) {
+            sitenamescap = sitenamescap ? sitenamescap*2 : 64;
+            sitenames = xrealloc(sitenames, sitenamescap*sizeof(char *));
+        }
+        sitenames[nsitenames] = name;
+        *id = nsitenames++;
     }
+
+    return *id;
 }
 
-Value *
-expand(Value *v, Env *env)
+// Returns where the tag of the object at p is kept, or NULL if p isn't
+// in the heap or the nursery. Pages get their sites arrays when one of
+// their objects is first tagged, so if create is 0, this can also
+// return NULL for an untagged object.
+uint32_t *
+tagof(void *p, int create)
 {
-    if (is_pair(v)) {
-        v = expandlist(v, env);
+    Page *np = pageof(p);
 
-        // if car(v) is not a symbol, lookupv will return nil
-        Value *macro = lookupv(car(v), env);
-        if (!is_macro(macro)) {
-            return v;
+    if (np != NULL) {
+        if (np->sites == NULL) {
+            if (!create) {
+                return NULL;
+            }
+            np->sites = xalloc(PAGEOBJS*sizeof(uint32_t));
         }
+        return &np->sites[((char *)p - pagebase(np)) / sizeof(Pair)];
+    }
 
-        Value *args = quotelist(cdr(v));
+    Segment *s = segfind(p);
 
-        return expand(apply(macro, args, env), env);
-    } else {
-        return v;
+    if (s != NULL) {
+        HPage *pg = &s->pages[((char *)p - s->base) / HPAGESIZE];
+        if (pg->sites == NULL) {
+            if (!create) {
+                return NULL;
+            }
+            pg->sites = xalloc(MAXOBJS*sizeof(uint32_t));
+        }
+        return &pg->sites[((char *)p - pg->base) / pg->size];
     }
-}
 
-Value *
-evif(Value *conditions, Env *env)
-{
-    if (is_nil(conditions)) {
-        return NULL;
-    } else if (length(conditions) == 1) {
-        return eval(car(conditions), env);
-    } else if (eval(car(conditions), env)) {
-        return eval(cadr(conditions), env);
-    } else {
-        return evif(cddr(conditions), env);
+    // largefind doesn't see the ones mapped since the last collection
+    Large *l = largefind(p);
+    for (size_t i = nsorted; l == NULL && i < nlarges; i++) {
+        if (larges[i].start == p) {
+            l = &larges[i];
+        }
     }
+
+    return l != NULL ? &l->site : NULL;
 }
 
-Value **
-evifslot(Value *conditions, Env *env)
+void
+tagsite(void *p)
 {
-    if (is_nil(conditions)) {
-        return NULL;
-    } else if (length(conditions) == 1) {
-        return evalslot(car(conditions), env);
-    } else if (eval(car(conditions), env)) {
-        return evalslot(cadr(conditions), env);
-    } else {
-        return evifslot(cddr(conditions), env);
+    uint32_t *tag = tagof(p, 1);
+    if (tag != NULL) {
+        *tag = siteid(sitename());
     }
 }
 
-Value *
-evlis(Value *params, Env *env)
+void
+untag(void *p)
 {
-    assert(is_pair(params) || is_nil(params));
-
-    if (is_nil(params)) {
-        return NULL;
-    } else {
-        return cons(eval(car(params), env), evlis(cdr(params), env));
+    uint32_t *tag = tagof(p, 0);
+    if (tag != NULL) {
+        *tag = 0;
     }
 }
 
-Value **
-evalslot(Value *v, Env *env)
+void
+movetag(void *from, void *to)
 {
-    if (is_pair(v) && car(v) == s_car) {
-        Value *p = eval(cadr(v), env);
+    uint32_t *tag = tagof(from, 0);
+    if (tag != NULL && *tag != 0) {
+        uint32_t site = *tag;
+        *tag = 0;
+        *tagof(to, 1) = site;
+    }
+}
 
-        if (is_pair(p)) {
-            return &p->pair.car;
-        } else {
-            return NULL;
-        }
-    } else if (is_pair(v) && car(v) == s_cdr) {
-        Value *p = eval(cadr(v), env);
+typedef struct SnapNode SnapNode;
+struct SnapNode {
+    void *p;
+    DumpKind kind; // D_VALUE, D_PAIR, D_ENV or D_CODE
+    size_t parent; // index in nodes, or (size_t)-1 for a root
+    char *edge; // the field of parent this was found in, or the kind of root
+    int index; // for fields and roots that are arrays, or -1
+};
 
-        if (is_pair(p)) {
-            return &p->pair.cdr;
-        } else {
-            return NULL;
-        }
-    } else if (is_pair(v) && car(v) == s_if) {
-        return evifslot(cdr(v), env);
-    } else if (is_pair(v) && car(v) == s_def) {
-        eval(v, env);
-        return evalslot(cadr(v), env);
-    } else if (is_pair(v) && car(v) == s_set) {
-        eval(v, env);
-        return evalslot(cadr(v), env);
-    } else if (is_pair(v)) {
-        Value *f = eval(car(v), env);
-
-        if (is_function(f)) {
-            checkargs(f->func.name, f->func.params, cdr(v));
-            Value *bindings = zipargs(f->func.params, evlis(cdr(v), env));
-            Env *newenv = clone(f->func.env);
-            newenv->bindings = bindings;
-
-            Value **slot;
-            for (Value *e = f->func.body; is_pair(e); e = cdr(e)) {
-                if (is_pair(cdr(e))) {
-                    eval(car(e), newenv);
-                } else {
-                    slot = evalslot(car(e), newenv);
-                }
-            }
+typedef struct SnapGroup SnapGroup;
+struct SnapGroup {
+    char *type;
+    char *site;
+    size_t count;
+    size_t bytes;
+    size_t first; // the node found first, which has the shortest path
+};
 
-            return slot;
-        } else {
-            return NULL;
-        }
-    } else if (is_symbol(v)) {
-        Value *binding = lookup(v, env);
-        if (binding == NULL) {
-            return NULL;
-        }
+typedef struct Snapshot Snapshot;
+struct Snapshot {
+    SnapNode *nodes; // in the order they were found, breadth first
+    size_t nnodes;
+    size_t nodescap;
+    AddrMap seen; // nodes by address
+};
 
-        return &binding->pair.cdr->pair.car;
-    } else {
-        return NULL;
+void
+snapvisit(Snapshot *s, void *p, DumpKind kind, size_t parent, char *edge, int index)
+{
+    if (p == NULL || (kind == D_VALUE && is_integer(p))) {
+        return;
     }
-}
 
-Value *
-evalquasi(Value *v, Env *env)
-{
-    if (is_pair(v) && car(v) == s_unquote) {
-        return eval(cadr(v), env);
-    } else if (is_pair(v) && car(v) == s_unquote_splicing) {
-        fprintf(stderr, "evalquasi: unquote-splicing not in list: ");
-        fprint(stderr, v);
-        exit(1);
-    } else if (is_pair(v) && caar(v) == s_unquote_splicing) {
-        Value *p = eval(cadar(v), env);
+    if (kind == D_VALUE && is_pair(p)) {
+        p = topair(p);
+        kind = D_PAIR;
+    }
 
-        if (!is_pair(p) && !is_nil(p)) {
-            fprintf(stderr, "evalquasi: expected list, got: ");
-            fprint(stderr, p);
-            exit(1);
-        }
+    size_t *slot = addrslot(&s->seen, p);
+    if (*slot != (size_t)-1) {
+        return;
+    }
+    *slot = s->nnodes;
 
-        return append(p, evalquasi(cdr(v), env));
-    } else if (is_pair(v)) {
-        return cons(evalquasi(car(v), env), evalquasi(cdr(v), env));
-    } else {
-        return v;
+    if (s->nnodes == s->nodescap) {
+        s->nodescap = s->nodescap ? s->nodescap*2 : 1024;
+        s->nodes = xrealloc(s->nodes, s->nodescap*sizeof(SnapNode));
     }
+    s->nodes[s->nnodes++] = (SnapNode){p, kind, parent, edge, index};
 }
 
-Env *globals = NULL;
-
-Value *
-eval(Value *v, Env *env)
+void
+snapfields(Snapshot *s, size_t i)
 {
-    if (is_pair(v) && car(v) == s_quote) {
-        return cadr(v);
-    } else if (is_pair(v) && car(v) == s_quasiquote) {
-        return evalquasi(cadr(v), env);
-    } else if (is_pair(v) && car(v) == s_if) {
-        return evif(cdr(v), env);
-    } else if (is_pair(v) && car(v) == s_fn) {
-        return mkfunc(FUNCTION, cadr(v), cddr(v), env);
-    } else if (is_pair(v) && car(v) == s_macro) {
-        return mkfunc(MACRO, cadr(v), cddr(v), env);
-    } else if (is_pair(v) && car(v) == s_def && length(v) > 3) {
-        // short form lambda definition, e.g. (def inc (x) (+ 1 x))
-        return eval(cons(s_def, cons(cadr(v), cons(cons(s_fn, cons(caddr(v), cdddr(v))), NULL))), env);
-    } else if (is_pair(v) && car(v) == s_def) {
-        Value *name = cadr(v);
-        Value *val = eval(caddr(v), env);
+    SnapNode n = s->nodes[i];
 
-        if (!is_symbol(name)) {
-            fprintf(stderr, "def: expected symbol\n");
-            exit(1);
-        }
+    if (n.kind == D_VALUE) {
+        Value *v = n.p;
 
-        Value *old = lookup(name, globals);
-        if (old) {
-            fprintf(stderr, "def: symbol already defined: ");
-            fprint(stderr, name);
-            exit(1);
+        switch (v->type) {
+        case SYMBOL:
+            if (v->sym.defined) {
+                snapvisit(s, v->sym.value, D_VALUE, i, "value", -1);
+            }
+            break;
+        case FUNCTION:
+        case MACRO:
+            snapvisit(s, v->func.params, D_VALUE, i, "params", -1);
+            snapvisit(s, v->func.body, D_VALUE, i, "body", -1);
+            snapvisit(s, v->func.env, D_ENV, i, "env", -1);
+            snapvisit(s, v->func.code, D_CODE, i, "code", -1);
+            break;
+        default:
+            // symbol names are in the symbol table already
+            break;
         }
+    } else if (n.kind == D_PAIR) {
+        Pair *p = n.p;
 
-        return def(name, val, globals);
-    } else if (is_pair(v) && car(v) == s_set) {
-        Value *lvar = cadr(v);
-        Value *val = eval(caddr(v), env);
+        snapvisit(s, p->car, D_VALUE, i, "car", -1);
+        snapvisit(s, p->cdr, D_VALUE, i, "cdr", -1);
+    } else if (n.kind == D_ENV) {
+        Env *e = n.p;
 
-        return set(lvar, val, env);
-    } else if (is_pair(v)) {
-        Value *f = eval(car(v), env);
-
-        if (is_function(f)) {
-            return apply(f, cdr(v), env);
-        } else if (is_builtin(f)) {
-            return f->builtin.imp(evlis(cdr(v), env));
-        } else if (is_macro(f)) {
-            fprintf(stderr, "can't call a macro at runtime: ");
-            fprint(stderr, car(v));
-            exit(1);
-        } else {
-            fprintf(stderr, "not a function: ");
-            fprint(stderr, car(v));
-            exit(1);
+        snapvisit(s, e->parent, D_ENV, i, "parent", -1);
+        for (int j = 0; j < e->nslots; j++) {
+            snapvisit(s, e->slots[j], D_VALUE, i, "slots", j);
         }
-    } else if (is_symbol(v)) {
-        Value *binding = lookup(v, env);
+    } else if (n.kind == D_CODE) {
+        Code *c = n.p;
 
-        if (binding) {
-            return cadr(binding);
-        } else {
-            fprintf(stderr, "unbound variable: %s\n", v->sym);
-            exit(1);
+        for (int j = 0; j < c->nconsts; j++) {
+            snapvisit(s, c->consts[j], D_VALUE, i, "consts", j);
         }
-    } else {
-        return v;
     }
 }
 
-void
-arity(Value *args, int expected, char *name)
-{
-    int actual = length(args);
+// The types in a snapshot are those of values, plus envs and code.
+#define SNAPTYPES (NTYPES+2)
+char *snaptypes[SNAPTYPES] = {"symbol", "string", "pair", "builtin", "function", "macro", "local", "env", "code"};
 
-    if (actual != expected) {
-        fprintf(stderr, "%s: expected %d arguments, got %d\n", name, expected, actual);
-        exit(1);
+int
+snaptype(SnapNode *n)
+{
+    if (n->kind == D_PAIR) {
+        return PAIR;
+    } else if (n->kind == D_ENV) {
+        return NTYPES;
+    } else if (n->kind == D_CODE) {
+        return NTYPES+1;
+    } else {
+        return ((Value *)n->p)->type;
     }
 }
 
-void
-varity(Value *args, int min, char *name)
+size_t
+snapbytes(SnapNode *n)
 {
-    int actual = length(args);
+    size_t size = dumpsize(n->p, n->kind);
 
-    if (actual < min) {
-        fprintf(stderr, "%s: expected %d or more arguments, got %d\n", name, min, actual);
-        exit(1);
+    if (n->kind == D_VALUE && ((Value *)n->p)->type == STRING) {
+        size += sizeof(Buf) + ((Value *)n->p)->str->cap;
     }
+
+    return size;
 }
 
-int
-allints(Value *l)
+// Writes the path from a root to node i, with runs of the same field
+// written once with a count, e.g. symbol xs -> value -> cdr*999 -> car.
+void
+snappath(FILE *f, Snapshot *s, size_t i)
 {
-    for (; l != NULL; l = cdr(l)) {
-        if (!is_integer(car(l))) {
-            return 0;
-        }
+    size_t n = 0;
+    for (size_t j = i; j != (size_t)-1; j = s->nodes[j].parent) {
+        n++;
     }
 
-    return 1;
-}
-
-#define builtin1(name) \
-    Value *builtin_##name(Value *args) { \
-        arity(args, 1, #name); \
-        return name(car(args)); \
+    size_t *path = xalloc(n*sizeof(size_t));
+    size_t k = n;
+    for (size_t j = i; j != (size_t)-1; j = s->nodes[j].parent) {
+        path[--k] = j;
     }
 
-#define builtin2(name) \
-    Value *builtin_##name(Value *args) { \
-        arity(args, 2, #name); \
-        return name(car(args), cadr(args)); \
+    SnapNode *root = &s->nodes[path[0]];
+    fprintf(f, "%s", root->edge);
+    if (root->kind == D_VALUE && ((Value *)root->p)->type == SYMBOL) {
+        fprintf(f, " %s", ((Value *)root->p)->sym.name);
+    } else if (root->index != -1) {
+        fprintf(f, "[%d]", root->index);
     }
 
-#define pred1(name) \
-    Value *builtin_is_##name(Value *args) { \
-        arity(args, 1, #name); \
-        return is_##name(car(args)) ? s_t : NULL; \
-    }
+    for (k = 1; k < n; ) {
+        SnapNode *e = &s->nodes[path[k]];
+        size_t run = 1;
 
-#define pred2(name) \
-    Value *builtin_is_##name(Value *args) { \
-        arity(args, 2, #name); \
-        return is_##name(car(args), cadr(args)) ? s_t : NULL; \
-    }
-
-#define op(op, name, init) \
-    Value *builtin_##name(Value *args) { \
-        if (!allints(args)) { return NULL; } \
-        int len = length(args); \
-        if (len == 0) { return mkint(init op init); } \
-        if (len == 1) { return mkint(init op car(args)->n); } \
-        long long res = car(args)->n; \
-        for (args = cdr(args); args != NULL; args = cdr(args)) { \
-            res = res op car(args)->n; \
-        } \
-        return mkint(res); \
-    }
+        while (e->index == -1 && k+run < n && s->nodes[path[k+run]].edge == e->edge) {
+            run++;
+        }
 
-#define comp(op, name) \
-    Value *builtin_##name(Value *args) { \
-        if (!allints(args)) { return NULL; } \
-        if (length(args) == 0) { return t; } \
-        Value *last = car(args); \
-        for (args = cdr(args); args != NULL; args = cdr(args)) { \
-            if (!(last->n op car(args)->n)) { \
-                return NULL; \
-            } \
-            last = car(args); \
-        } \
-        return t; \
+        fprintf(f, " -> %s", e->edge);
+        if (e->index != -1) {
+            fprintf(f, "[%d]", e->index);
+        }
+        if (run > 1) {
+            fprintf(f, "*%zu", run);
+        }
+
+        k += run;
     }
 
-builtin1(car)
-builtin1(cdr)
-builtin2(cons)
+    free(path);
+}
 
-Value *
-builtin_length(Value *args)
+int
+cmpgroup(const void *a, const void *b)
 {
-    arity(args, 1, "length");
-    return mkint(length(car(args)));
+    const SnapGroup *x = a, *y = b;
+    return (x->bytes < y->bytes) - (x->bytes > y->bytes);
 }
 
-pred1(nil)
-pred1(symbol)
-pred1(string)
-pred1(integer)
-pred1(pair)
-pred1(function)
-pred1(builtin)
-pred1(procedure)
+// Returns the number of live bytes, or -1 if path can't be written.
+long long
+heapsnapshot(char *path)
+{
+    Snapshot s = {0};
 
-pred2(eq)
-pred2(eqv)
-pred2(equal)
+    for (Root *r = roots; r != NULL; r = r->next) {
+        if (r->p == (void *)&symtab) {
+            for (size_t i = 0; i < symtabcap; i++) {
+                snapvisit(&s, symtab[i], D_VALUE, (size_t)-1, "symbol", -1);
+            }
+        } else {
+            snapvisit(&s, *r->p, D_VALUE, (size_t)-1, "root", -1);
+        }
+    }
 
-op(+, plus, 0)
-op(-, minus, 0)
-op(*, times, 1)
-op(/, divide_, 1)
+    for (Value **p = vmstack; p < vmsp; p++) {
+        snapvisit(&s, *p, D_VALUE, (size_t)-1, "vm stack", p - vmstack);
+    }
 
-Value *
-builtin_divide(Value *args)
-{
-    varity(args, 1, "/");
+    for (size_t i = 0; i < nframes; i++) {
+        snapvisit(&s, frames[i].env, D_ENV, (size_t)-1, "vm frame env", i);
+        snapvisit(&s, frames[i].code, D_CODE, (size_t)-1, "vm frame code", i);
+    }
 
-    for (Value *a = args; is_pair(a); a = cdr(a)) {
-        if (car(a)->n == 0) {
-            fprintf(stderr, "/: division by zero\n");
-            exit(1);
-        }
+    for (size_t i = 0; i < s.nnodes; i++) {
+        snapfields(&s, i);
     }
 
-    return builtin_divide_(args);
-}
+    // sites to their row in bysite, which has an index in groups for
+    // each type, or -1
+    SnapGroup *groups = NULL;
+    size_t ngroups = 0, groupscap = 0;
+    AddrMap sites = {0};
+    size_t (*bysite)[SNAPTYPES] = NULL;
+    size_t nsites = 0, sitescap = 0;
+    size_t total = 0;
+
+    for (size_t i = 0; i < s.nnodes; i++) {
+        SnapNode *n = &s.nodes[i];
+        uint32_t *tag = tagof(n->p, 0);
+        char *site = tag != NULL && *tag != 0 ? sitenames[*tag] : "-";
+        int type = snaptype(n);
+
+        size_t *row = addrslot(&sites, site);
+        if (*row == (size_t)-1) {
+            if (nsites == sitescap) {
+                sitescap = sitescap ? sitescap*2 : 64;
+                bysite = xrealloc(bysite, sitescap*sizeof(bysite[0]));
+            }
+            memset(bysite[nsites], 0xff, sizeof(bysite[0]));
+            *row = nsites++;
+        }
 
-comp(>, gt)
-comp(<, lt)
-comp(>=, ge)
-comp(<=, le)
-// == for the c operator, but = in def_op below for Lisp.
-// different from is_eq, which is eq?
-comp(==, eq)
+        size_t *g = &bysite[*row][type];
+        if (*g == (size_t)-1) {
+            if (ngroups == groupscap) {
+                groupscap = groupscap ? groupscap*2 : 64;
+                groups = xrealloc(groups, groupscap*sizeof(SnapGroup));
+            }
+            groups[ngroups] = (SnapGroup){snaptypes[type], site, 0, 0, i};
+            *g = ngroups++;
+        }
 
-Value *
-load(char *path)
-{
-    FILE *f = fopen(path, "r");
-    if (!f) {
-        fprintf(stderr, "load: can't open %s\n", path);
-        exit(1);
+        size_t bytes = snapbytes(n);
+        groups[*g].count++;
+        groups[*g].bytes += bytes;
+        total += bytes;
     }
 
-    while (peek(f) != EOF) {
-        Value *v = read(f);
-        v = expand(v, globals);
-        eval(v, globals);
+    qsort(groups, ngroups, sizeof(SnapGroup), cmpgroup);
+
+    FILE *f = fopen(path, "w");
+    if (f != NULL) {
+        fprintf(f, "heap snapshot: %zu objects, %zu bytes%s\n\n", s.nnodes, total,
+            heapprof ? "" : " (run with --heap-profile for sites)");
+        fprintf(f, "%-10s %-24s %10s %12s  %s\n", "type", "site", "count", "bytes", "path");
+
+        for (size_t i = 0; i < ngroups; i++) {
+            SnapGroup *g = &groups[i];
+
+            fprintf(f, "%-10s %-24s %10zu %12zu  ", g->type, g->site, g->count, g->bytes);
+            snappath(f, &s, g->first);
+            fprintf(f, "\n");
+        }
     }
 
-    fclose(f);
+    free(groups);
+    free(bysite);
+    addrfree(&sites);
+    addrfree(&s.seen);
+    free(s.nodes);
 
-    return NULL;
+    if (f == NULL || fclose(f) != 0) {
+        return -1;
+    }
+
+    return total;
 }
 
 Value *
-builtin_load(Value *args)
+builtin_heap_snapshot(int argc, Value **argv)
 {
-    arity(args, 1, "load");
-
-    Value *path = car(args);
+    Value *path = argv[0];
 
     if (!is_string(path)) {
-        fprintf(stderr, "load: path must be a string\n");
+        fprintf(stderr, "heap-snapshot: path must be a string\n");
         exit(1);
     }
 
-    return load(path->str->s);
+    long long bytes = heapsnapshot(path->str->s);
+    if (bytes == -1) {
+        fprintf(stderr, "heap-snapshot: can't write %s\n", path->str->s);
+        exit(1);
+    }
+
+    return mkint(bytes);
 }
 
+// bench/bench.c includes this file for its microbenchmarks and has a
+// main of its own.
+#ifndef NOMAIN
+
 #define symbol(name) s_##name = intern(#name)
-#define def_builtin(name) def(intern(#name), mkbuiltin(#name, builtin_##name), globals)
-#define def_pred(name) def(intern(#name "?"), mkbuiltin(#name "?", builtin_is_##name), globals)
-#define def_op(op, name) def(intern(#op), mkbuiltin(#op, builtin_##name), globals)
 
 int
 main(int argc, char *argv[])
 {
     gcinit();
+    nurseryinit();
+
+    char *dump = NULL, *image = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--tree-walk") == 0) {
+            treewalk = 1;
+        } else if (strcmp(argv[i], "--read-stats") == 0) {
+            readstats = 1;
+            atexit(printreadstats);
+        } else if (strcmp(argv[i], "--profile") == 0 && i+1 < argc) {
+            profiling = 1;
+            tracing = 1;
+            profpath = argv[++i];
+        } else if (strcmp(argv[i], "--heap-profile") == 0) {
+            heapprof = 1;
+            tracing = 1;
+        } else if (strcmp(argv[i], "--gc-pause") == 0 && i+1 < argc) {
+            incremental = 1;
+            pausetarget = atof(argv[++i]) / 1e6;
+            nurserylimit = NURSERYMIN; // until minorgc has measured it
+        } else if (strcmp(argv[i], "--gc-threads") == 0 && i+1 < argc) {
+            int n = atoi(argv[++i]);
+            gcthreads = n < 1 ? 1 : n > MAXMARKERS ? MAXMARKERS : n;
+        } else if (strcmp(argv[i], "--bulk-output") == 0) {
+            bulkout = 1;
+            atexit(flushout);
+        } else if (strcmp(argv[i], "--dump-image") == 0 && i+1 < argc) {
+            dump = argv[++i];
+        } else if (strcmp(argv[i], "--image") == 0 && i+1 < argc) {
+            image = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--tree-walk] [--read-stats] [--bulk-output] [--profile path] [--heap-profile] [--gc-pause us] [--gc-threads n] [--dump-image path] [--image path]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if (profiling) {
+        profstart();
+        atexit(profreport);
+    }
+
+    if (getenv("LC_GCSTATS") != NULL) {
+        atexit(printgcstats);
+    }
 
-    globals = clone(NULL);
-    gcroot(globals);
+    // The symbols and their forms are in the image too, but the s_*
+    // variables still need setting.
+    if (image != NULL) {
+        loadimage(image);
+    }
 
     symbol(t); t = s_t; // return t seems more ergonomic and clear than return s_t
-    def(t, t, globals);
     symbol(nil);
 
     symbol(car);
@@ -1440,46 +6602,51 @@ main(int argc, char *argv[])
     symbol(car);
     symbol(cdr);
 
-    def_builtin(car);
-    def_builtin(cdr);
-    def_builtin(cons);
-    def_builtin(length);
-
-    def_pred(nil);
-    def_pred(symbol);
-    def_pred(string);
-    def_pred(integer);
-    def_pred(pair);
-    def_pred(function);
-    def_pred(builtin);
-    def_pred(procedure);
-
-    def_pred(eq);
-    def_pred(eqv);
-    def_pred(equal);
-
-    def_builtin(print);
-    def_builtin(load);
-
-    def_op(+, plus);
-    def_op(-, minus);
-    def_op(*, times);
-    def_op(/, divide);
-
-    def_op(>, gt);
-    def_op(<, lt);
-    def_op(>=, ge);
-    def_op(<=, le);
-    // = for Lisp land, but == above in comp for the C operator.
-    def_op(=, eq);
+    s_quote->sym.form = FORM_QUOTE;
+    s_quasiquote->sym.form = FORM_QUASIQUOTE;
+    s_if->sym.form = FORM_IF;
+    s_fn->sym.form = FORM_FN;
+    s_macro->sym.form = FORM_MACRO;
+    s_def->sym.form = FORM_DEF;
+    s_set->sym.form = FORM_SET;
+    s_car->sym.form = FORM_CAR;
+    s_cdr->sym.form = FORM_CDR;
+
+    if (image == NULL) {
+        def(t, t);
+
+        for (size_t i = 0; i < nbuiltins; i++) {
+            Builtin *b = &builtins[i];
+            def(intern(b->name), mkbuiltin(b->name, b->imp, b->min, b->max));
+        }
+
+        load("lib.lisp");
+    }
 
-    load("lib.lisp");
+    if (dump != NULL) {
+        dumpimage(dump);
+        return 0;
+    }
 
-    while (peek(stdin) != EOF) {
-        Value *v = read(stdin);
-        v = expand(v, globals);
-        v = eval(v, globals);
+    Reader in;
+    rinit(&in, 0);
+
+    phase = PHASE_READ;
+    while (peek(&in) != EOF) {
+        Value *v = readform(&in);
+        arenaenter();
+        phase = PHASE_EXPAND;
+        v = expand(v, NULL);
+        phase = PHASE_RESOLVE;
+        v = resolve(v, NULL);
+        v = arenaexit(v);
+        phase = PHASE_EVAL;
+        v = run(v);
+        phase = PHASE_PRINT;
         print(v);
+        phase = PHASE_READ;
     }
     return 0;
 }
+
+#endif